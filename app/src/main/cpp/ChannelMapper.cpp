@@ -0,0 +1,108 @@
+#include "ChannelMapper.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CHANNEL_MAPPER_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CHANNEL_MAPPER_SSE2
+#endif
+
+static constexpr int32_t kUnityGain = 1 << 15;
+
+ChannelMapper::ChannelMapper(int32_t inputChannelCount, int32_t outputChannelCount)
+        : mInputChannelCount(inputChannelCount),
+          mOutputChannelCount(outputChannelCount) {
+    if (inputChannelCount == outputChannelCount) {
+        mKernel = copy;
+    } else if (inputChannelCount == 1 && outputChannelCount == 2) {
+        mKernel = monoToStereo;
+    } else if (inputChannelCount == 2 && outputChannelCount == 1) {
+        mKernel = stereoToMono;
+    } else {
+        // Upmix repeats the input channels cyclically, downmix folds them onto the outputs
+        // cyclically and averages. Channel layouts are not known beyond the count.
+        mKernel = mixMatrix;
+        mMatrix.assign(outputChannelCount * inputChannelCount, 0);
+        for (int32_t output = 0; output < outputChannelCount; ++output) {
+            if (inputChannelCount < outputChannelCount) {
+                mMatrix[output * inputChannelCount + output % inputChannelCount] = kUnityGain;
+                continue;
+            }
+            int32_t folded = (inputChannelCount - output + outputChannelCount - 1) / outputChannelCount;
+            for (int32_t input = output; input < inputChannelCount; input += outputChannelCount) {
+                mMatrix[output * inputChannelCount + input] = kUnityGain / folded;
+            }
+        }
+    }
+}
+
+void ChannelMapper::copy(const ChannelMapper& mapper, const int16_t *input, int16_t *output, int32_t numFrames) {
+    memcpy(output, input, numFrames * mapper.mOutputChannelCount * sizeof(int16_t));
+}
+
+void ChannelMapper::monoToStereo(const ChannelMapper&, const int16_t *input, int16_t *output, int32_t numFrames) {
+    int32_t frame = 0;
+#if defined(CHANNEL_MAPPER_NEON)
+    for (; frame + 8 <= numFrames; frame += 8) {
+        int16x8_t mono = vld1q_s16(input + frame);
+        int16x8x2_t stereo = {{mono, mono}};
+        vst2q_s16(output + frame * 2, stereo);
+    }
+#elif defined(CHANNEL_MAPPER_SSE2)
+    for (; frame + 8 <= numFrames; frame += 8) {
+        __m128i mono = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + frame));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(output + frame * 2), _mm_unpacklo_epi16(mono, mono));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(output + frame * 2 + 8), _mm_unpackhi_epi16(mono, mono));
+    }
+#endif
+    for (; frame < numFrames; ++frame) {
+        output[frame * 2] = input[frame];
+        output[frame * 2 + 1] = input[frame];
+    }
+}
+
+// Average rounds towards negative infinity in every kernel, so the output is the same on all ABIs
+void ChannelMapper::stereoToMono(const ChannelMapper&, const int16_t *input, int16_t *output, int32_t numFrames) {
+    int32_t frame = 0;
+#if defined(CHANNEL_MAPPER_NEON)
+    for (; frame + 8 <= numFrames; frame += 8) {
+        int16x8x2_t stereo = vld2q_s16(input + frame * 2);
+        vst1q_s16(output + frame, vhaddq_s16(stereo.val[0], stereo.val[1]));
+    }
+#elif defined(CHANNEL_MAPPER_SSE2)
+    const __m128i ones = _mm_set1_epi16(1);
+    for (; frame + 8 <= numFrames; frame += 8) {
+        __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + frame * 2));
+        __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + frame * 2 + 8));
+        __m128i lowSums = _mm_srai_epi32(_mm_madd_epi16(low, ones), 1);
+        __m128i highSums = _mm_srai_epi32(_mm_madd_epi16(high, ones), 1);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(output + frame), _mm_packs_epi32(lowSums, highSums));
+    }
+#endif
+    for (; frame < numFrames; ++frame) {
+        output[frame] = static_cast<int16_t>((input[frame * 2] + input[frame * 2 + 1]) >> 1);
+    }
+}
+
+void ChannelMapper::mixMatrix(const ChannelMapper& mapper, const int16_t *input, int16_t *output, int32_t numFrames) {
+    const int32_t inputChannelCount = mapper.mInputChannelCount;
+    const int32_t outputChannelCount = mapper.mOutputChannelCount;
+    const int32_t *matrix = mapper.mMatrix.data();
+
+    for (int32_t frame = 0; frame < numFrames; ++frame) {
+        for (int32_t channel = 0; channel < outputChannelCount; ++channel) {
+            const int32_t *gains = matrix + channel * inputChannelCount;
+            int32_t sum = 0;
+            for (int32_t i = 0; i < inputChannelCount; ++i) {
+                sum += input[i] * gains[i];
+            }
+            output[channel] = static_cast<int16_t>(std::min(std::max(sum >> 15, -32768), 32767));
+        }
+        input += inputChannelCount;
+        output += outputChannelCount;
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Maps interleaved I16 frames of the decoded file to the channel count the stream was opened with:
+ * copies them as is, duplicates mono to stereo, downmixes stereo to mono, or mixes any other counts
+ * through a matrix. The kernel is selected once on creation, so mapping a chunk costs a single
+ * indirect call on top of the kernel itself, and the same channel count is a plain memcpy.
+ */
+class ChannelMapper {
+public:
+    ChannelMapper() : ChannelMapper(1, 1) {}
+    ChannelMapper(int32_t inputChannelCount, int32_t outputChannelCount);
+
+    void map(const int16_t *input, int16_t *output, int32_t numFrames) const {
+        mKernel(*this, input, output, numFrames);
+    }
+
+    int32_t getInputChannelCount() const { return mInputChannelCount; }
+    int32_t getOutputChannelCount() const { return mOutputChannelCount; }
+
+private:
+    using Kernel = void (*)(const ChannelMapper& mapper, const int16_t *input, int16_t *output, int32_t numFrames);
+
+    static void copy(const ChannelMapper& mapper, const int16_t *input, int16_t *output, int32_t numFrames);
+    static void monoToStereo(const ChannelMapper& mapper, const int16_t *input, int16_t *output, int32_t numFrames);
+    static void stereoToMono(const ChannelMapper& mapper, const int16_t *input, int16_t *output, int32_t numFrames);
+    static void mixMatrix(const ChannelMapper& mapper, const int16_t *input, int16_t *output, int32_t numFrames);
+
+    int32_t mInputChannelCount;
+    int32_t mOutputChannelCount;
+    Kernel mKernel;
+
+    // Q15 gains, mMatrix[output * mInputChannelCount + input]
+    std::vector<int32_t> mMatrix;
+};
@@ -18,22 +18,56 @@
 #define SAMPLES_DEFAULT_DATA_CALLBACK_H
 
 
+#include <algorithm>
+#include <chrono>
+#include <ctime>
 #include <vector>
+#include <sys/resource.h>
 #include <oboe/AudioStreamCallback.h>
 #include "logging_macros.h"
+#include <thread>
 #include "IRenderableAudio.h"
 #include "IRestartable.h"
+#include "PerformanceHint.h"
+#include "RenderAhead.h"
+#include "RenderGraph.h"
+#include "Trace.h"
 
 /**
- * This is a callback object which will render data from an `IRenderableAudio` source.
+ * This is a callback object which will render data from a `RenderGraph`.
+ *
+ * The graph is published to the audio thread through an atomic pointer, so the callback never
+ * touches a reference count or a lock. A replaced graph is deleted by the thread which has
+ * published the new one, once the audio thread is known not to use it anymore.
+ *
+ * Every callback reports its wall time work duration to a performance hint session, if enabled,
+ * and counts it in a histogram together with the callbacks which missed their deadline. The session
+ * is opened and closed by the `PerformanceHintController` thread, not by the callback.
+ *
+ * With render-ahead set, the graph is rendered by a worker thread into a `RenderAheadBuffer` and
+ * the callback only copies the frames out of it.
  */
 class DefaultDataCallback : public oboe::AudioStreamDataCallback {
 public:
     DefaultDataCallback() {}
-    virtual ~DefaultDataCallback() = default;
+    virtual ~DefaultDataCallback() {
+        setRenderAhead(nullptr);
+        delete mGraph.exchange(nullptr);
+    }
+
+    // Callback durations by powers of two from kMinDurationMicros, the last bucket is open ended
+    static constexpr int kDurationBucketCount = 12;
+    static constexpr int64_t kMinDurationMicros = 32;
+
+    struct TimingStats {
+        int64_t durationHistogram[kDurationBucketCount] = {0};
+        int64_t deadlineMisses = 0;
+    };
 
     virtual oboe::DataCallbackResult
     onAudioReady(oboe::AudioStream *oboeStream, void *audioData, int32_t numFrames) override {
+        TRACE_SCOPE("DefaultDataCallback::onAudioReady");
+        auto beginTime = std::chrono::steady_clock::now();
 
         if (mIsThreadAffinityEnabled && !mIsThreadAffinitySet) {
             setThreadAffinity();
@@ -42,28 +76,105 @@ public:
 
         int16_t *outputBuffer = static_cast<int16_t*>(audioData);
 
-        std::shared_ptr<IRenderableAudio> localRenderable = mRenderable;
-        if (!localRenderable) {
-            LOGE("Renderable source not set!");
+        timespec cpuTimeBefore, cpuTimeAfter;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuTimeBefore);
+
+        RenderAheadBuffer *renderAhead = mRenderAheadBuffer.load();
+        if (renderAhead) {
+            renderAhead->read(outputBuffer, numFrames);
+        } else if (!renderGraph(outputBuffer, numFrames, oboeStream->getSampleRate())) {
+            LOGE("Render graph not set!");
             return oboe::DataCallbackResult::Stop;
         }
-        localRenderable->renderAudio(outputBuffer, numFrames);
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuTimeAfter);
+        mCpuTimeNanos += getNanos(cpuTimeAfter) - getNanos(cpuTimeBefore);
+        mCallbackCount++;
+
+        int64_t workNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - beginTime).count();
+        reportWorkDuration(oboeStream, numFrames, workNanos);
+
         return oboe::DataCallbackResult::Continue;
     }
 
-    void setSource(std::shared_ptr<IRenderableAudio> renderable) {
-        mRenderable = renderable;
+    /**
+     * Publish a compiled graph to the audio thread. Blocks until the previous graph is released by
+     * the audio thread, which takes at most one callback, so must not be called from the audio thread.
+     * Graphs are only deleted here, so calls must be serialized with each other and with
+     * getGraphCostReport by the caller, as OboeEngine does with its lock.
+     */
+    void setGraph(std::unique_ptr<RenderGraph> graph) {
+        RenderGraph *previousGraph = mGraph.exchange(graph.release());
+        while (previousGraph && mGraphInUse.load() == previousGraph) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        delete previousGraph;
+    }
+
+    /**
+     * Render a single source without any processing.
+     */
+    void setSource(std::shared_ptr<IRenderableAudio> renderable, int32_t channelCount, int32_t maxFrames) {
+        auto graph = std::make_unique<RenderGraph>(channelCount, maxFrames);
+        graph->setOutput(graph->addSource(std::move(renderable)));
+        graph->compile();
+        setGraph(std::move(graph));
     }
 
     /**
-     * Reset the callback to its initial state.
+     * Render the graph on a worker thread up to the buffer capacity ahead of the callbacks, which
+     * then only copy the rendered frames. nullptr makes the callbacks render the graph again.
+     * The worker of the previous buffer is stopped first, so must not be called while the stream
+     * is running.
+     */
+    void setRenderAhead(std::shared_ptr<RenderAheadBuffer> buffer) {
+        if (mRenderAheadThread.joinable()) {
+            mIsRenderAheadStopping = true;
+            mRenderAheadThread.join();
+            mIsRenderAheadStopping = false;
+        }
+        mRenderAheadBuffer.store(buffer.get());
+        mRenderAhead = buffer;
+        if (buffer) {
+            mRenderAheadThread = std::thread(&DefaultDataCallback::runRenderAhead, this, std::move(buffer));
+        }
+    }
+
+    /**
+     * @return frames the callbacks had to fill with silence as the worker was late, 0 without
+     * render-ahead
+     */
+    int64_t getRenderAheadSilenceFrames() {
+        return mRenderAhead ? mRenderAhead->getSilenceFrames() : 0;
+    }
+
+    /**
+     * Burn the given fraction of the audio duration rendered in busy CPU time on top of the graph,
+     * on whichever thread renders it. Used to benchmark the callback timing under load.
+     */
+    void setSyntheticLoad(double loadFraction) {
+        mSyntheticLoad = loadFraction;
+    }
+
+    /**
+     * Reset the callback to its initial state, the stream it has been rendering is already closed.
      */
     void reset(){
         mIsThreadAffinitySet = false;
+        setRenderAhead(nullptr);
+        // The next stream calls back on another thread
+        mHintController.setThreadId(PerformanceHintController::kAudioThread, 0);
     }
 
-    std::shared_ptr<IRenderableAudio> getSource() {
-        return mRenderable;
+    /**
+     * @return average processing time of every node of the current graph. The audio thread's
+     * hazard slot only protects the graph it renders, so this relies on the caller's lock serializing
+     * it with setGraph and setSource, which delete the previous graph.
+     */
+    std::string getGraphCostReport() {
+        RenderGraph *graph = mGraph.load();
+        return graph ? graph->getCostReport() : std::string();
     }
 
     /**
@@ -87,12 +198,157 @@ public:
         LOGD("Thread affinity enabled: %s", (isEnabled) ? "true" : "false");
     }
 
+    /**
+     * Report the callback work duration to the system, so it can adjust the CPU to the load. The
+     * session covers the audio thread and the render-ahead worker, but only the callbacks report,
+     * so with render-ahead the reported work is the copy of the rendered frames, not the rendering.
+     */
+    void setPerformanceHintEnabled(bool isEnabled) {
+        mHintController.setEnabled(isEnabled);
+    }
+
+    /**
+     * @return callback duration histogram and deadline misses since the callback was created
+     */
+    TimingStats getTimingStats() {
+        TimingStats stats;
+        for (int i = 0; i < kDurationBucketCount; i++) {
+            stats.durationHistogram[i] = mDurationHistogram[i];
+        }
+        stats.deadlineMisses = mDeadlineMisses;
+        return stats;
+    }
+
+    /**
+     * @return number of callbacks which have rendered audio
+     */
+    int64_t getCallbackCount() { return mCallbackCount; }
+
+    /**
+     * @return CPU time spent in rendering audio by the audio callback thread and the render-ahead
+     * worker
+     */
+    int64_t getCpuTimeNanos() { return mCpuTimeNanos; }
+
 private:
-    std::shared_ptr<IRenderableAudio> mRenderable;
+    std::atomic<RenderGraph*> mGraph { nullptr };
+    std::atomic<RenderGraph*> mGraphInUse { nullptr };
+    std::atomic<int64_t> mCallbackCount { 0 };
+    std::atomic<int64_t> mCpuTimeNanos { 0 };
     std::vector<int> mCpuIds; // IDs of CPU cores which the audio callback should be bound to
     std::atomic<bool> mIsThreadAffinityEnabled { false };
     std::atomic<bool> mIsThreadAffinitySet { false };
 
+    std::atomic<int64_t> mDurationHistogram[kDurationBucketCount] = {};
+    std::atomic<int64_t> mDeadlineMisses { 0 };
+    std::atomic<double> mSyntheticLoad { 0 };
+
+    // The pointer is loaded by the audio thread, which doesn't touch the reference count
+    std::shared_ptr<RenderAheadBuffer> mRenderAhead;
+    std::atomic<RenderAheadBuffer*> mRenderAheadBuffer { nullptr };
+    std::atomic<bool> mIsRenderAheadStopping { false };
+    std::thread mRenderAheadThread;
+
+    PerformanceHintController mHintController;
+
+    // ANDROID_PRIORITY_URGENT_AUDIO, the worker has to keep up with the audio thread
+    static constexpr int kRenderAheadNice = -19;
+
+    static int64_t getNanos(const timespec& time) {
+        return time.tv_sec * 1000000000LL + time.tv_nsec;
+    }
+
+    /**
+     * Render the current graph into the output, @return false if no graph is set
+     */
+    bool renderGraph(int16_t *outputBuffer, int32_t numFrames, int32_t sampleRate) {
+        // Announce the graph in use and make sure it hasn't been replaced meanwhile, @see setGraph
+        RenderGraph *graph = mGraph.load();
+        mGraphInUse.store(graph);
+        while (graph != mGraph.load()) {
+            graph = mGraph.load();
+            mGraphInUse.store(graph);
+        }
+
+        if (!graph) return false;
+
+        graph->render(outputBuffer, numFrames);
+        mGraphInUse.store(nullptr);
+
+        double syntheticLoad = mSyntheticLoad;
+        if (syntheticLoad > 0) {
+            TRACE_SCOPE("DefaultDataCallback::syntheticLoad");
+            auto endTime = std::chrono::steady_clock::now() + std::chrono::nanoseconds(
+                    static_cast<int64_t>(syntheticLoad * numFrames * 1000000000LL / sampleRate));
+            while (std::chrono::steady_clock::now() < endTime) {}
+        }
+        return true;
+    }
+
+    /**
+     * Keep the buffer filled chunk by chunk, sleeping half a chunk whenever there is no room for one.
+     */
+    void runRenderAhead(std::shared_ptr<RenderAheadBuffer> buffer) {
+        if (setpriority(PRIO_PROCESS, gettid(), kRenderAheadNice) != 0) {
+            LOGW("Can't raise the render-ahead thread priority");
+        }
+        mHintController.setThreadId(PerformanceHintController::kWorkerThread, gettid());
+
+        const int32_t chunkFrames = buffer->getChunkFrames();
+        const auto idleTime = std::chrono::microseconds(chunkFrames * 500000LL / buffer->getSampleRate());
+
+        while (!mIsRenderAheadStopping) {
+            if (buffer->getFreeFrames() < chunkFrames) {
+                std::this_thread::sleep_for(idleTime);
+                continue;
+            }
+
+            timespec cpuTimeBefore, cpuTimeAfter;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuTimeBefore);
+
+            // The region ends at the end of the ring, the rest of the chunk is rendered next time
+            int32_t numFrames;
+            int16_t *region = buffer->getWriteRegion(numFrames);
+            numFrames = std::min(numFrames, chunkFrames);
+            if (!renderGraph(region, numFrames, buffer->getSampleRate())) {
+                std::this_thread::sleep_for(idleTime);
+                continue;
+            }
+            buffer->commitWrite(numFrames);
+
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuTimeAfter);
+            mCpuTimeNanos += getNanos(cpuTimeAfter) - getNanos(cpuTimeBefore);
+            TRACE_COUNTER("renderAheadQueuedFrames", buffer->getQueuedFrames());
+        }
+        mHintController.setThreadId(PerformanceHintController::kWorkerThread, 0);
+    }
+
+    /**
+     * The callback has to finish before the frames still buffered are played, which is the buffer
+     * size less the frames being rendered, and before the next callback is due. A single buffered
+     * stream is given half of the callback period.
+     */
+    static int64_t getDeadlineNanos(oboe::AudioStream *oboeStream, int32_t numFrames) {
+        int32_t bufferedFrames = std::max(oboeStream->getBufferSizeInFrames() - numFrames, numFrames / 2);
+        return std::min(bufferedFrames, numFrames) * 1000000000LL / oboeStream->getSampleRate();
+    }
+
+    void reportWorkDuration(oboe::AudioStream *oboeStream, int32_t numFrames, int64_t workNanos) {
+        int64_t deadlineNanos = getDeadlineNanos(oboeStream, numFrames);
+        if (workNanos > deadlineNanos) {
+            mDeadlineMisses++;
+        }
+
+        int64_t micros = workNanos / 1000;
+        int bucket = 0;
+        for (int64_t limit = kMinDurationMicros; micros >= limit && bucket < kDurationBucketCount - 1; limit *= 2) {
+            bucket++;
+        }
+        mDurationHistogram[bucket]++;
+
+        mHintController.reportWorkDuration(gettid(), workNanos, deadlineNanos);
+    }
+
     /**
      * Set the thread affinity for the current thread to mCpuIds. This can be useful to call on the
      * audio thread to avoid underruns caused by CPU core migrations to slower CPU cores.
@@ -41,7 +41,7 @@ public:
         // reason.
         if (error == oboe::Result::ErrorDisconnected) {
             LOGI("Restarting AudioStream");
-            mParent.restart();
+            mParent.restart(oboeStream);
         }
         LOGE("Error was %s", oboe::convertToText(error));
     }
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * The part of an output stream `SoundGenerator` is synchronized against: its format, the number
+ * of frames written to it, its latency and the clock.
+ *
+ * It is implemented on top of an oboe stream on device, @see OboePlaybackStream, and simulated by
+ * the offline renderer, so the very same synchronization code can be run on a host.
+ * The stream format is always I16.
+ */
+class IPlaybackStream {
+public:
+    virtual ~IPlaybackStream() = default;
+
+    virtual int32_t getSampleRate() const = 0;
+    virtual int32_t getChannelCount() const = 0;
+    virtual int64_t getFramesWritten() = 0;
+
+    /**
+     * @return false if the stream is not able to calculate its latency yet
+     */
+    virtual bool calculateLatencyMillis(double &latencyMills) = 0;
+
+    /**
+     * @return frames already written which still have to reach the device stream, they add up to
+     * the latency calculated by the device stream, @see RenderAheadStream
+     */
+    virtual int64_t getPipelineFrames() { return 0; }
+
+    /**
+     * @return current time in milliseconds, all timestamps used for synchronization are in this base
+     */
+    virtual double nowMills() = 0;
+
+    int32_t getBytesPerSample() const { return sizeof(int16_t); }
+    int32_t getBytesPerFrame() const { return getChannelCount() * getBytesPerSample(); }
+};
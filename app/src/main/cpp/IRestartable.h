@@ -16,6 +16,10 @@
 #ifndef SAMPLES_IRESTARTABLE_H
 #define SAMPLES_IRESTARTABLE_H
 
+namespace oboe {
+class AudioStream;
+}
+
 /**
  * Represents an object which can be restarted. For example an audio engine which has one or more
  * streams which can be restarted following a change in audio device configuration. For example,
@@ -23,6 +27,10 @@
  */
 class IRestartable {
 public:
-    virtual void restart() = 0;
+    /**
+     * The stream has been disconnected and closed. An object with several streams, or which has
+     * replaced the stream meanwhile, tells by it whether and what to restart.
+     */
+    virtual void restart(oboe::AudioStream *disconnectedStream) = 0;
 };
 #endif //SAMPLES_IRESTARTABLE_H
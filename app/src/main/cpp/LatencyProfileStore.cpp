@@ -0,0 +1,114 @@
+#include "LatencyProfileStore.h"
+#include "logging_macros.h"
+
+#include <algorithm>
+#include <cstdio>
+
+// Version 1 had no route type, its profiles may mix routes, so they are dropped
+static constexpr int kStoreVersion = 2;
+static constexpr size_t kMaxProfiles = 32;
+
+// Caps the weight of the history, so the profile keeps following firmware and route changes.
+static constexpr int64_t kMaxMeasurements = 10000;
+
+LatencyProfileKey LatencyProfileKey::fromStream(const std::shared_ptr<oboe::AudioStream>& oboeStream, int32_t routeType) {
+    LatencyProfileKey key;
+    key.routeType = routeType;
+    key.deviceId = oboeStream->getDeviceId();
+    key.audioApi = static_cast<int32_t>(oboeStream->getAudioApi());
+    key.sampleRate = oboeStream->getSampleRate();
+    key.framesPerBurst = oboeStream->getFramesPerBurst();
+    return key;
+}
+
+LatencyProfileStore::LatencyProfileStore(std::string filePath)
+        : mFilePath(std::move(filePath)) {}
+
+bool LatencyProfileStore::load() {
+    mProfiles.clear();
+    if (mFilePath.empty()) return false;
+
+    FILE *fp = fopen(mFilePath.c_str(), "r");
+    if (!fp) return false;
+
+    int version = 0;
+    if (fscanf(fp, "%d", &version) != 1 || version != kStoreVersion) {
+        LOGW("Latency profile store: unsupported version %d", version);
+        fclose(fp);
+        return false;
+    }
+
+    Profile profile;
+    long long measurements = 0;
+    while (mProfiles.size() < kMaxProfiles
+            && fscanf(fp, "%d %d %d %d %d %lf %lld",
+                    &profile.key.routeType,
+                    &profile.key.deviceId,
+                    &profile.key.audioApi,
+                    &profile.key.sampleRate,
+                    &profile.key.framesPerBurst,
+                    &profile.latencyMills,
+                    &measurements) == 7) {
+        if (profile.latencyMills <= 0 || measurements <= 0) continue;
+        profile.measurements = measurements;
+        mProfiles.push_back(profile);
+    }
+
+    fclose(fp);
+    LOGD("Latency profile store: %d profiles loaded", static_cast<int>(mProfiles.size()));
+    return true;
+}
+
+bool LatencyProfileStore::save() const {
+    if (mFilePath.empty()) return false;
+
+    // Write to a temporary file first, so the store is never left half written
+    std::string tmpPath = mFilePath + ".tmp";
+    FILE *fp = fopen(tmpPath.c_str(), "w");
+    if (!fp) {
+        LOGE("Latency profile store: can't open %s", tmpPath.c_str());
+        return false;
+    }
+
+    fprintf(fp, "%d\n", kStoreVersion);
+    for (const auto& profile : mProfiles) {
+        fprintf(fp, "%d %d %d %d %d %.3f %lld\n",
+                profile.key.routeType,
+                profile.key.deviceId,
+                profile.key.audioApi,
+                profile.key.sampleRate,
+                profile.key.framesPerBurst,
+                profile.latencyMills,
+                static_cast<long long>(profile.measurements));
+    }
+
+    bool isWritten = fflush(fp) == 0;
+    isWritten = fclose(fp) == 0 && isWritten;
+    return isWritten && rename(tmpPath.c_str(), mFilePath.c_str()) == 0;
+}
+
+double LatencyProfileStore::getLatencyMills(const LatencyProfileKey& key, double defaultLatencyMills) const {
+    auto it = std::find_if(mProfiles.begin(), mProfiles.end(),
+            [&key](const Profile& profile) { return profile.key == key; });
+    return it != mProfiles.end() ? it->latencyMills : defaultLatencyMills;
+}
+
+void LatencyProfileStore::update(const LatencyProfileKey& key, double latencyMills, int64_t measurements) {
+    if (latencyMills <= 0 || measurements <= 0) return;
+
+    Profile profile { key, latencyMills, std::min(measurements, kMaxMeasurements) };
+
+    auto it = std::find_if(mProfiles.begin(), mProfiles.end(),
+            [&key](const Profile& profile) { return profile.key == key; });
+    if (it != mProfiles.end()) {
+        int64_t total = it->measurements + profile.measurements;
+        profile.latencyMills = (it->latencyMills * it->measurements + latencyMills * profile.measurements) / total;
+        profile.measurements = std::min(total, kMaxMeasurements);
+        mProfiles.erase(it);
+    } else if (mProfiles.size() >= kMaxProfiles) {
+        mProfiles.erase(mProfiles.begin());
+    }
+
+    mProfiles.push_back(profile);
+    mVersion++;
+}
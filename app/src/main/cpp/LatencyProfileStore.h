@@ -0,0 +1,76 @@
+#pragma once
+
+#include <oboe/Oboe.h>
+#include <string>
+#include <vector>
+
+/**
+ * Identifies an output route for which the latency has been learned. The store file lives in
+ * the app private directory, so every profile is implicitly per-device.
+ *
+ * OpenSL ES streams report no device id, so the route is also told apart by the type of the output
+ * device the system plays to, an `AudioDeviceInfo` type detected on the Java side.
+ *
+ * Frames per burst is used instead of the buffer size, because the latter is changed by
+ * `oboe::LatencyTuner` while the stream is running.
+ */
+struct LatencyProfileKey {
+    int32_t routeType = 0; // AudioDeviceInfo.TYPE_UNKNOWN
+    int32_t deviceId = oboe::kUnspecified;
+    int32_t audioApi = static_cast<int32_t>(oboe::AudioApi::Unspecified);
+    int32_t sampleRate = oboe::kUnspecified;
+    int32_t framesPerBurst = oboe::kUnspecified;
+
+    static LatencyProfileKey fromStream(const std::shared_ptr<oboe::AudioStream>& oboeStream, int32_t routeType);
+
+    bool operator==(const LatencyProfileKey& other) const {
+        return routeType == other.routeType
+                && deviceId == other.deviceId
+                && audioApi == other.audioApi
+                && sampleRate == other.sampleRate
+                && framesPerBurst == other.framesPerBurst;
+    }
+};
+
+/**
+ * Small persistent cache of output latencies measured by `oboe::AudioStream::calculateLatencyMillis`.
+ *
+ * It is used to seed the position estimator of a freshly opened stream, before the stream is able
+ * to report its own timestamps.
+ */
+class LatencyProfileStore {
+public:
+    explicit LatencyProfileStore(std::string filePath);
+
+    bool load();
+    bool save() const;
+
+    /**
+     * @return the learned latency for the key or defaultLatencyMills if nothing is known about it
+     */
+    double getLatencyMills(const LatencyProfileKey& key, double defaultLatencyMills) const;
+
+    /**
+     * Merge a mean latency of the finished session into the profile of the key.
+     *
+     * @param latencyMills mean latency measured during the session
+     * @param measurements number of successful measurements the mean is based on
+     */
+    void update(const LatencyProfileKey& key, double latencyMills, int64_t measurements);
+
+    /**
+     * @return number of updates since the store was loaded, so the latest of several copies is known
+     */
+    int64_t getVersion() const { return mVersion; }
+
+private:
+    struct Profile {
+        LatencyProfileKey key;
+        double latencyMills;
+        int64_t measurements;
+    };
+
+    const std::string mFilePath;
+    std::vector<Profile> mProfiles; // ordered from the least to the most recently updated
+    int64_t mVersion = 0;
+};
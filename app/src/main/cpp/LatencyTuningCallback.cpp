@@ -15,9 +15,11 @@
  */
 
 #include "LatencyTuningCallback.h"
+#include "Trace.h"
 
 oboe::DataCallbackResult LatencyTuningCallback::onAudioReady(
      oboe::AudioStream *oboeStream, void *audioData, int32_t numFrames) {
+    TRACE_SCOPE("LatencyTuningCallback::onAudioReady");
     if (oboeStream != mStream) {
         mStream = oboeStream;
         mLatencyTuner = std::make_unique<oboe::LatencyTuner>(*oboeStream);
@@ -25,6 +27,7 @@ oboe::DataCallbackResult LatencyTuningCallback::onAudioReady(
     if (mBufferTuneEnabled
             && mLatencyTuner
             && oboeStream->getAudioApi() == oboe::AudioApi::AAudio) {
+        TRACE_SCOPE("LatencyTuner::tune");
         mLatencyTuner->tune();
     }
 
@@ -16,7 +16,30 @@
 
 #include "OboeEngine.h"
 #include "SoundGenerator.h"
+#include "OboePlaybackStream.h"
 #include "utils.h"
+#include "Trace.h"
+
+#include <cstdio>
+#include <limits>
+
+// Time the incoming stream runs silently before the switch, so it can measure its own latency
+static constexpr int64_t kHandoverWarmUpMills = 300;
+static constexpr double kHandoverMarginMills = 20;
+// Longest time play waits for the stream to measure its latency, if it has not been warmed up
+static constexpr int64_t kPlayLatencyWaitMills = 300;
+static constexpr int64_t kPlayLatencyPollMills = 5;
+
+static std::string sLatencyProfilePath;
+static std::atomic<int32_t> sOutputRouteType {0};
+
+void OboeEngine::setLatencyProfilePath(const std::string& filePath) {
+    sLatencyProfilePath = filePath;
+}
+
+void OboeEngine::setOutputRouteType(int32_t routeType) {
+    sOutputRouteType = routeType;
+}
 
 /**
  * Main audio engine. It is responsible for:
@@ -26,6 +49,9 @@
  * - Restarting the stream when user-controllable properties (Audio API, channel count etc) are
  * changed, and when the stream is disconnected (e.g. when headphones are attached)
  * - Calculating the audio latency of the stream
+ * - Learning the audio latency of the stream route, so the next session starts with a better guess
+ * - Handing the playback over between the low latency and the power saving streams, and between
+ * rendering in the callbacks and rendering ahead on a worker thread
  *
  */
 OboeEngine::OboeEngine()
@@ -33,14 +59,17 @@ OboeEngine::OboeEngine()
         , mErrorCallback(std::make_unique<DefaultErrorCallback>(*this))
         , mChannelCount(oboe::DefaultStreamValues::ChannelCount)
         , mSampleRate(oboe::DefaultStreamValues::SampleRate)
-{}
+        , mLatencyProfileStore(sLatencyProfilePath)
+        , mStreamStartMills(millsNow())
+{
+    mLatencyProfileStore.load();
+}
 
 double OboeEngine::getCurrentOutputLatencyMillis() {
     std::lock_guard<std::mutex> lock(mLock);
     if (!mStream) return -1.0;
 
-    auto latencyResult = mStream->calculateLatencyMillis();
-    return latencyResult ? latencyResult.value() : kDefaultLatency;
+    return mAudioSource->getLatencyMills();
 }
 
 int64_t OboeEngine::getCurrentPositionMills() {
@@ -48,31 +77,115 @@ int64_t OboeEngine::getCurrentPositionMills() {
     return mAudioSource ? mAudioSource->getCurrentPositionMills() : -1;
 }
 
-oboe::Result OboeEngine::createPlaybackStream() {
+int64_t OboeEngine::getTotalPatchMills() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mReplacedPatchMills + (mAudioSource ? mAudioSource->getTotalPatchMills() : 0);
+}
+
+oboe::Result OboeEngine::createPlaybackStream(bool isPowerSaving,
+                                              LatencyTuningCallback *callback,
+                                              std::shared_ptr<oboe::AudioStream>& stream) {
+    // Tuning would shrink the buffer down to the minimum, which is the opposite of power saving
+    callback->setBufferTuneEnabled(!isPowerSaving);
+
     oboe::AudioStreamBuilder builder;
-    return builder.setSharingMode(oboe::SharingMode::Exclusive)
-        ->setPerformanceMode(oboe::PerformanceMode::LowLatency)
+    return builder.setSharingMode(isPowerSaving ? oboe::SharingMode::Shared : oboe::SharingMode::Exclusive)
+        ->setPerformanceMode(isPowerSaving ? oboe::PerformanceMode::PowerSaving : oboe::PerformanceMode::LowLatency)
         ->setFormat(oboe::AudioFormat::I16)
-        ->setDataCallback(mLatencyCallback.get())
+        ->setDataCallback(callback)
         ->setErrorCallback(mErrorCallback.get())
         ->setChannelCount(mChannelCount)
         ->setSampleRate(mSampleRate)
-        ->openStream(mStream);
+        ->openStream(stream);
 }
 
-void OboeEngine::restart() {
+std::shared_ptr<RenderAheadBuffer> OboeEngine::createRenderAhead(const std::shared_ptr<oboe::AudioStream>& stream,
+                                                              int32_t renderAheadMills) {
+    if (renderAheadMills <= 0) return nullptr;
+
+    // At least two chunks, so the worker can render one while the callbacks consume the other
+    int32_t chunkFrames = stream->getFramesPerBurst();
+    int32_t capacityFrames = std::max(2 * chunkFrames,
+            static_cast<int32_t>(static_cast<int64_t>(renderAheadMills) * stream->getSampleRate() / 1000));
+    return std::make_shared<RenderAheadBuffer>(stream->getSampleRate(), stream->getChannelCount(),
+            capacityFrames, chunkFrames);
+}
+
+std::shared_ptr<SoundGenerator> OboeEngine::createAudioSource(const std::shared_ptr<oboe::AudioStream>& stream,
+                                                              const std::shared_ptr<RenderAheadBuffer>& renderAhead) {
+    std::shared_ptr<IPlaybackStream> playbackStream = std::make_shared<OboePlaybackStream>(stream);
+    if (renderAhead) {
+        playbackStream = std::make_shared<RenderAheadStream>(playbackStream, renderAhead);
+    }
+    auto source = std::make_shared<SoundGenerator>(playbackStream);
+    auto key = LatencyProfileKey::fromStream(stream, sOutputRouteType);
+    source->setDefaultLatencyMills(mLatencyProfileStore.getLatencyMills(key, kDefaultLatency));
+    return source;
+}
+
+void OboeEngine::restart(oboe::AudioStream *disconnectedStream) {
+    TRACE_SCOPE("OboeEngine::restart");
+    std::unique_lock<std::mutex> lock(mLock);
+    if (mIsStopping || disconnectedStream == nullptr) return;
+
+    if (mIncomingStream && disconnectedStream == mIncomingStream.get()) {
+        // The current stream plays on, the handover thread closes the incoming one and gives up
+        LOGW("Handover: incoming stream disconnected");
+        mIsHandoverCancelled = true;
+        mHandoverCondition.notify_all();
+        return;
+    }
+    // A stream which has been handed over is closed by the handover itself
+    if (disconnectedStream != mStream.get()) return;
+
+    // An incoming stream is likely routed to the same device, so the handover is given up before
+    // the current stream is replaced, and requested again on the new one
+    mIsHandoverCancelled = true;
+    mHandoverCondition.notify_all();
+    mHandoverCondition.wait(lock, [this] { return !mIsHandoverRunning; });
+    if (mIsStopping) return;
+
     // The stream will have already been closed by the error callback.
+    std::unique_ptr<LatencyProfileStore> profiles = collectLatencyProfile();
+    collectTimingStats();
+    std::shared_ptr<SoundGenerator> previousSource = mAudioSource;
+    if (previousSource) {
+        mSyncMetrics.add(previousSource->getSyncMetrics());
+        mReplacedPatchMills += previousSource->getTotalPatchMills();
+    }
     mLatencyCallback->reset();
-    start();
+    // The playback goes on from where the disconnected stream has left it
+    openStream(previousSource);
+    requestHandover(lock);
+    if (lock.owns_lock()) lock.unlock();
+    saveLatencyProfile(std::move(profiles));
 }
 
 oboe::Result OboeEngine::start() {
+    TRACE_SCOPE("OboeEngine::start");
     std::lock_guard<std::mutex> lock(mLock);
+    return openStream();
+}
 
-    auto result = createPlaybackStream();
+/**
+ * Open and start the stream in the current mode, its source continues the playback of the previous
+ * one if any. Must be called under the lock.
+ */
+oboe::Result OboeEngine::openStream(const std::shared_ptr<SoundGenerator>& previousSource) {
+    mIsStandingBy = false;
+    auto result = createPlaybackStream(mIsPowerSaving, mLatencyCallback.get(), mStream);
     if (result == oboe::Result::OK){
-        mAudioSource =  std::make_shared<SoundGenerator>(mStream);
-        mLatencyCallback->setSource(std::dynamic_pointer_cast<IRenderableAudio>(mAudioSource));
+        auto renderAhead = createRenderAhead(mStream, mRenderAheadMills);
+        mAudioSource = createAudioSource(mStream, renderAhead);
+        if (previousSource) mAudioSource->continueFrom(*previousSource);
+        mLatencyProfileKey = LatencyProfileKey::fromStream(mStream, sOutputRouteType);
+        mTimingBaseline.xRuns = 0;
+        mTimingBaseline.renderAheadSilenceFrames = 0;
+
+        mLatencyCallback->setSyntheticLoad(mSyntheticLoad);
+        mLatencyCallback->setSource(mAudioSource, mStream->getChannelCount(), mStream->getBufferCapacityInFrames());
+        // The worker starts rendering the new source only, @see DefaultDataCallback::reset
+        mLatencyCallback->setRenderAhead(renderAhead);
         mStream->start();
 
         LOGD("Stream opened: AudioAPI = %d, channelCount = %d, sampleRate = %d, deviceID = %d",
@@ -86,12 +199,553 @@ oboe::Result OboeEngine::start() {
     return result;
 }
 
+bool OboeEngine::setTimeline(std::shared_ptr<Timeline> timeline) {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mStream && timeline->getSampleRate() != mStream->getSampleRate()) {
+        // The frames are played as they are, so the whole schedule would be off pitch and tempo
+        LOGE("Timeline sample rate %d differs from the stream one %d", timeline->getSampleRate(), mStream->getSampleRate());
+        return false;
+    }
+    mTimeline = timeline;
+    mAudioSource->prepare(std::move(timeline));
+    if (mIncomingAudioSource) mIncomingAudioSource->continueFrom(*mAudioSource);
+    return true;
+}
+
+bool OboeEngine::prefetch(int64_t serverTimeMills) {
+    std::shared_ptr<Timeline> timeline;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        timeline = mTimeline;
+    }
+    if (!timeline) return false;
+
+    int64_t positionMills = timeline->getPositionMills(serverTimeMills);
+    return timeline->prefetch(positionMills * timeline->getSampleRate() / 1000);
+}
+
+bool OboeEngine::hasMeasuredLatency() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mAudioSource && mAudioSource->getLatencyMeasurements() > 0;
+}
+
+/**
+ * Wait until the stream has measured its latency, at most `kPlayLatencyWaitMills` since the time.
+ * @return whether it has
+ */
+bool OboeEngine::waitForLatency(double sinceMills) {
+    while (!hasMeasuredLatency() && preciseMillsNow() - sinceMills < kPlayLatencyWaitMills) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(kPlayLatencyPollMills));
+    }
+    return hasMeasuredLatency();
+}
+
+void OboeEngine::standBy() {
+    TRACE_SCOPE("OboeEngine::standBy");
+    if (!waitForLatency(preciseMillsNow())) {
+        LOGD("standBy: latency not measured, the stream keeps running");
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mLock);
+    // A handover running meanwhile would start the stream again, @see requestHandover
+    if (!mStream || mAudioSource->isPlaying() || mIsHandoverRunning) return;
+
+    // The timestamps take a few callbacks to come back after the pause, the learned latency
+    // positions the first buffer meanwhile
+    mAudioSource->setDefaultLatencyMills(mAudioSource->getLearnedLatencyMills());
+    if (mStream->requestPause() == oboe::Result::OK) {
+        mIsStandingBy = true;
+        LOGD("standBy: stream paused until play, latency %.1f", mAudioSource->getLearnedLatencyMills());
+    }
+}
+
+void OboeEngine::play(int64_t serverTimeMills) {
+    TRACE_SCOPE("OboeEngine::play");
+    double callMills = preciseMillsNow();
+    std::shared_ptr<Timeline> timeline;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        timeline = mTimeline;
+    }
+    if (!timeline) {
+        LOGE("play: the timeline is not set");
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mLock);
+        if (mIsStandingBy) {
+            mIsStandingBy = false;
+            mStream->requestStart();
+            // Deferred while standing by
+            requestHandover(lock);
+        }
+    }
+
+    // Map the first tracks before the playback starts, unless they already are, the time it takes is skipped
+    if (!prefetch(serverTimeMills)) {
+        LOGE("play: the tracks can't be mapped, they play as silence");
+    }
+
+    // The first buffer is positioned with the latency of the stream, so once it is measured the
+    // first sample is presented in sync and no correction follows. A stream opened in advance has
+    // measured it already.
+    waitForLatency(callMills);
+    auto waitMills = static_cast<int64_t>(preciseMillsNow() - callMills);
+    LOGD("play: started after %lld ms, latency %s", static_cast<long long>(waitMills),
+            hasMeasuredLatency() ? "measured" : "not measured yet");
+
+    int64_t peerSyncSizeMills = -1;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mAudioSource->play(timeline->getPositionMills(serverTimeMills + waitMills), callMills);
+        if (mIncomingAudioSource) mIncomingAudioSource->continueFrom(*mAudioSource);
+        if (mIsPeerSyncEnabled && !mPeerSync) peerSyncSizeMills = mAudioSource->getSizeMills();
+    }
+    if (peerSyncSizeMills >= 0) {
+        startPeerSync(peerSyncSizeMills);
+    }
+}
+
+int64_t OboeEngine::getTimelinePositionMills(int64_t serverTimeMills) {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mTimeline ? mTimeline->getPositionMills(serverTimeMills) : -1;
+}
+
+void OboeEngine::setPeerSyncEnabled(bool isEnabled) {
+    std::unique_ptr<PeerSync> peerSync;
+    int64_t peerSyncSizeMills = -1;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mIsPeerSyncEnabled = isEnabled;
+        if (!isEnabled) {
+            peerSync = std::move(mPeerSync);
+        } else if (!mPeerSync && mAudioSource && mAudioSource->isPlaying()) {
+            peerSyncSizeMills = mAudioSource->getSizeMills();
+        }
+    }
+
+    if (peerSyncSizeMills >= 0) {
+        startPeerSync(peerSyncSizeMills);
+    } else if (!isEnabled) {
+        // Stopped before the shift is cleared, so its thread doesn't set it again
+        peerSync.reset();
+        std::lock_guard<std::mutex> lock(mLock);
+        if (!mPeerSync) {
+            if (mAudioSource) mAudioSource->setPeerShift(0);
+            if (mIncomingAudioSource) mIncomingAudioSource->setPeerShift(0);
+        }
+    }
+}
+
+void OboeEngine::setPlaybackShift(int64_t playbackShiftMills) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mAudioSource->setPlaybackShift(playbackShiftMills);
+    if (mIncomingAudioSource) mIncomingAudioSource->setPlaybackShift(playbackShiftMills);
+}
+
+int32_t OboeEngine::getPeerCount() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mPeerSync ? mPeerSync->getPeerCount() : 0;
+}
+
+void OboeEngine::startPeerSync(int64_t sizeMills) {
+    // PeerSync calls back from its own thread, so the source is always accessed under the lock,
+    // and it is started and stopped without holding it
+    auto peerSync = std::make_unique<PeerSync>(
+            [this]() {
+                std::lock_guard<std::mutex> lock(mLock);
+                return mAudioSource ? mAudioSource->getTargetPositionMills() : -1;
+            },
+            [this](int64_t shiftMills) {
+                std::lock_guard<std::mutex> lock(mLock);
+                if (mAudioSource) mAudioSource->setPeerShift(shiftMills);
+                if (mIncomingAudioSource) mIncomingAudioSource->setPeerShift(shiftMills);
+            });
+
+    if (!peerSync->start(sizeMills)) {
+        LOGW("Can't start peer sync");
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mIsPeerSyncEnabled && !mPeerSync && !mIsStopping) {
+            mPeerSync = std::move(peerSync);
+        }
+    }
+    // Otherwise disabled, stopped or started by another call meanwhile
+    peerSync.reset();
+}
+
 void OboeEngine::stop() {
+    std::unique_ptr<PeerSync> peerSync;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mIsStopping = true;
+        peerSync = std::move(mPeerSync);
+    }
+    mHandoverCondition.notify_all();
+    if (mHandoverThread.joinable()) {
+        mHandoverThread.join();
+    }
+
+    // Must be stopped before taking the lock, as its thread may be waiting for it
+    peerSync.reset();
+
     // Stop, close and delete in case not already closed.
+    std::unique_ptr<LatencyProfileStore> profiles;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mStream) {
+            mStream->stop();
+            mStream->close();
+            mStream.reset();
+        }
+        mLatencyCallback->setRenderAhead(nullptr);
+        profiles = collectLatencyProfile();
+    }
+    saveLatencyProfile(std::move(profiles));
+}
+
+/**
+ * Merge the latency learned by the current source into the store. Must be called under mLock.
+ * @return copy of the store to be saved once the lock is released, or nullptr if nothing was learned
+ */
+std::unique_ptr<LatencyProfileStore> OboeEngine::collectLatencyProfile() {
+    if (!mAudioSource || mAudioSource->getLatencyMeasurements() == 0) return nullptr;
+
+    mLatencyProfileStore.update(mLatencyProfileKey,
+            mAudioSource->getLearnedLatencyMills(),
+            mAudioSource->getLatencyMeasurements());
+    return std::make_unique<LatencyProfileStore>(mLatencyProfileStore);
+}
+
+/**
+ * Write a copy of the store, unless a later one has been written already. Must be called without mLock.
+ */
+void OboeEngine::saveLatencyProfile(std::unique_ptr<LatencyProfileStore> profiles) {
+    if (!profiles) return;
+
+    std::lock_guard<std::mutex> lock(mLatencyProfileFileLock);
+    if (profiles->getVersion() <= mSavedLatencyProfileVersion) return;
+    if (profiles->save()) {
+        mSavedLatencyProfileVersion = profiles->getVersion();
+    } else {
+        LOGW("Can't save latency profile");
+    }
+}
+
+void OboeEngine::setPowerSavingEnabled(bool isEnabled) {
+    std::unique_lock<std::mutex> lock(mLock);
+    mIsPowerSavingRequested = isEnabled;
+    requestHandover(lock);
+}
+
+void OboeEngine::setRenderAheadMills(int32_t renderAheadMills) {
+    std::unique_lock<std::mutex> lock(mLock);
+    mRenderAheadMillsRequested = std::max(0, renderAheadMills);
+    requestHandover(lock);
+}
+
+void OboeEngine::setSyntheticLoad(double loadFraction) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mSyntheticLoad = loadFraction;
+    mLatencyCallback->setSyntheticLoad(loadFraction);
+    if (mIncomingCallback) mIncomingCallback->setSyntheticLoad(loadFraction);
+}
+
+// Must be called under the lock
+bool OboeEngine::isHandoverRequested() {
+    return mIsPowerSavingRequested != mIsPowerSaving || mRenderAheadMillsRequested != mRenderAheadMills;
+}
+
+/**
+ * Start the handover thread unless it is already running, it hands the playback over until the
+ * stream is the requested one. A stream standing by is handed over once play resumes it, so the
+ * incoming stream doesn't run meanwhile either.
+ */
+void OboeEngine::requestHandover(std::unique_lock<std::mutex>& lock) {
+    if (mIsHandoverRunning || mIsStopping || mIsStandingBy || !mStream || !isHandoverRequested()) return;
+
+    // The previous handover thread, if any, has already finished
+    std::thread previousThread = std::move(mHandoverThread);
+    mIsHandoverRunning = true;
+    mHandoverThread = std::thread(&OboeEngine::runHandovers, this);
+    lock.unlock();
+
+    if (previousThread.joinable()) {
+        previousThread.join();
+    }
+}
+
+void OboeEngine::runHandovers() {
+    while (true) {
+        bool isPowerSaving;
+        int32_t renderAheadMills;
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            isPowerSaving = mIsPowerSavingRequested;
+            renderAheadMills = mRenderAheadMillsRequested;
+            if (mIsStopping || mIsHandoverCancelled || mIsStandingBy || !mStream || !isHandoverRequested()) {
+                finishHandovers();
+                return;
+            }
+        }
+
+        // The mode may have been requested back meanwhile, so check it again
+        if (!handOver(isPowerSaving, renderAheadMills)) {
+            std::lock_guard<std::mutex> lock(mLock);
+            finishHandovers();
+            return;
+        }
+    }
+}
+
+// Must be called under the lock
+void OboeEngine::finishHandovers() {
+    mIsHandoverRunning = false;
+    mIsHandoverCancelled = false;
+    // restart waits for it
+    mHandoverCondition.notify_all();
+}
+
+/**
+ * Hand the playback over to a new stream opened in the requested mode without losing the timeline:
+ *
+ * 1) Open and start the incoming stream with a silent source continuing the timeline of the current one
+ * 2) Let it run until its latency can be calculated, its source synchronizes itself using that latency
+ * 3) Choose a switch time which is further than the latency of both streams, fade the outgoing source
+ * out and the incoming one in at the frames presented at that time
+ * 4) Once the switch has been presented, close the outgoing stream
+ */
+bool OboeEngine::handOver(bool isPowerSaving, int32_t renderAheadMills) {
+    TRACE_SCOPE("OboeEngine::handOver");
+
+    // Opening and starting a stream may block for a while, so they don't hold the lock the getters
+    // polled by the UI take; the stream and its callback are only published under it
+    auto callback = std::make_unique<LatencyTuningCallback>();
+    std::shared_ptr<oboe::AudioStream> stream;
+    auto result = createPlaybackStream(isPowerSaving, callback.get(), stream);
+    if (result != oboe::Result::OK) {
+        LOGE("Handover: error creating playback stream. Error: %s", oboe::convertToText(result));
+        return false;
+    }
+
+    auto isAborted = [this] { return mIsStopping || mIsHandoverCancelled; };
+    std::unique_lock<std::mutex> lock(mLock);
+    // Both sources must share the same samples and the same timeline
+    bool isCompatible = stream->getSampleRate() == mStream->getSampleRate()
+            && stream->getChannelCount() == mStream->getChannelCount();
+    if (!isCompatible || isAborted()) {
+        lock.unlock();
+        if (!isCompatible) {
+            LOGW("Handover: incompatible stream: sampleRate = %d, channelCount = %d",
+                    stream->getSampleRate(),
+                    stream->getChannelCount());
+        }
+        stream->close();
+        return false;
+    }
+
+    auto renderAhead = createRenderAhead(stream, renderAheadMills);
+    mIncomingAudioSource = createAudioSource(stream, renderAhead);
+    mIncomingAudioSource->continueFrom(*mAudioSource);
+    mIncomingAudioSource->setFadeIn(std::numeric_limits<double>::max());
+    mIncomingAudioSource->setMetricsEnabled(false);
+
+    mIncomingCallback = std::move(callback);
+    mIncomingCallback->setPerformanceHintEnabled(mIsPerformanceHintEnabled);
+    mIncomingCallback->setSyntheticLoad(mSyntheticLoad);
+    mIncomingCallback->setSource(mIncomingAudioSource,
+            stream->getChannelCount(),
+            stream->getBufferCapacityInFrames());
+    mIncomingCallback->setRenderAhead(renderAhead);
+    mIncomingStream = stream;
+    mIncomingStartMills = millsNow();
+    lock.unlock();
+
+    // Only this thread replaces or closes the incoming stream, restart cancels the handover
+    stream->start();
+    lock.lock();
+
+    mHandoverCondition.wait_for(lock, std::chrono::milliseconds(kHandoverWarmUpMills), isAborted);
+    if (isAborted()) {
+        closeIncomingStream(lock);
+        return false;
+    }
+
+    // Frames already rendered ahead are presented before the switch, so they don't need the fade
+    double outgoingLatencyMills = mAudioSource->getLatencyMills();
+    double incomingLatencyMills = mIncomingAudioSource->getLatencyMills();
+    double switchMills = preciseMillsNow() + std::max(outgoingLatencyMills, incomingLatencyMills) + kHandoverMarginMills;
+
+    mAudioSource->setFadeOut(switchMills);
+    mIncomingAudioSource->setFadeIn(switchMills);
+    mIncomingAudioSource->setMetricsEnabled(true);
+
+    // Everything the outgoing stream writes after the fade has been presented is silent
+    auto closeTime = std::chrono::steady_clock::now()
+            + std::chrono::microseconds(static_cast<int64_t>((switchMills + kHandoverFadeMills - preciseMillsNow()) * 1000));
+    mHandoverCondition.wait_until(lock, closeTime, isAborted);
+    if (isAborted()) {
+        // The outgoing source plays on, audible again if it has faded out already
+        mAudioSource->setFadeOut(0);
+        closeIncomingStream(lock);
+        return false;
+    }
+
+    std::unique_ptr<LatencyProfileStore> profiles = collectLatencyProfile();
+
+    CallbackStats &stats = mCallbackStats[mIsPowerSaving];
+    stats.callbackCount += mLatencyCallback->getCallbackCount();
+    stats.cpuTimeNanos += mLatencyCallback->getCpuTimeNanos();
+    stats.durationMills += millsNow() - mStreamStartMills;
+    collectTimingStats();
+    mTimingBaseline = TimingStats();
+    // The outgoing source stopped recording at the switch, where the incoming one started
+    mSyncMetrics.add(mAudioSource->getSyncMetrics());
+    mReplacedPatchMills += mAudioSource->getTotalPatchMills();
+
+    std::shared_ptr<oboe::AudioStream> outgoingStream = std::move(mStream);
+    std::unique_ptr<LatencyTuningCallback> outgoingCallback = std::move(mLatencyCallback);
+
+    mStream = std::move(mIncomingStream);
+    mLatencyCallback = std::move(mIncomingCallback);
+    mAudioSource = std::move(mIncomingAudioSource);
+    mAudioSource->setFadeIn(0);
+    mLatencyProfileKey = LatencyProfileKey::fromStream(mStream, sOutputRouteType);
+    mStreamStartMills = mIncomingStartMills;
+    mIsPowerSaving = isPowerSaving;
+    mRenderAheadMills = renderAheadMills;
+    lock.unlock();
+    saveLatencyProfile(std::move(profiles));
+
+    LOGD("Handover: switched to %s, render-ahead %d ms, latency %.1f -> %.1f",
+            isPowerSaving ? "power saving" : "low latency",
+            renderAheadMills,
+            outgoingLatencyMills,
+            incomingLatencyMills);
+
+    // The callback object must outlive its stream
+    outgoingStream->stop();
+    outgoingStream->close();
+    return true;
+}
+
+/**
+ * Close the incoming stream of a handover given up. Takes it over under the lock and stops it
+ * without, the lock is released on return.
+ */
+void OboeEngine::closeIncomingStream(std::unique_lock<std::mutex>& lock) {
+    std::shared_ptr<oboe::AudioStream> stream = std::move(mIncomingStream);
+    std::unique_ptr<LatencyTuningCallback> callback = std::move(mIncomingCallback);
+    mIncomingAudioSource.reset();
+    lock.unlock();
+
+    // The callback object must outlive its stream
+    if (stream) {
+        stream->stop();
+        stream->close();
+    }
+    callback.reset();
+}
+
+void OboeEngine::setPerformanceHintEnabled(bool isEnabled) {
+    std::lock_guard<std::mutex> lock(mLock);
+    collectTimingStats();
+    mIsPerformanceHintEnabled = isEnabled;
+    mLatencyCallback->setPerformanceHintEnabled(isEnabled);
+    if (mIncomingCallback) mIncomingCallback->setPerformanceHintEnabled(isEnabled);
+}
+
+/**
+ * Add what the current callback and stream have counted since the last collection to the stats of
+ * the current render-ahead and performance hint states.
+ */
+void OboeEngine::collectTimingStats() {
+    TimingStats &stats = mTimingStats[mRenderAheadMills > 0][mIsPerformanceHintEnabled];
+    DefaultDataCallback::TimingStats callbackStats = mLatencyCallback->getTimingStats();
+    for (int i = 0; i < DefaultDataCallback::kDurationBucketCount; i++) {
+        stats.durationHistogram[i] += callbackStats.durationHistogram[i] - mTimingBaseline.durationHistogram[i];
+        mTimingBaseline.durationHistogram[i] = callbackStats.durationHistogram[i];
+    }
+    stats.deadlineMisses += callbackStats.deadlineMisses - mTimingBaseline.deadlineMisses;
+    mTimingBaseline.deadlineMisses = callbackStats.deadlineMisses;
+    int64_t silenceFrames = mLatencyCallback->getRenderAheadSilenceFrames();
+    stats.renderAheadSilenceFrames += silenceFrames - mTimingBaseline.renderAheadSilenceFrames;
+    mTimingBaseline.renderAheadSilenceFrames = silenceFrames;
+
+    // A closed stream doesn't tell its xruns anymore
+    if (!mStream) return;
+    auto xRuns = mStream->getXRunCount();
+    if (xRuns) {
+        stats.xRuns += xRuns.value() - mTimingBaseline.xRuns;
+        mTimingBaseline.xRuns = xRuns.value();
+    }
+}
+
+std::string OboeEngine::getCallbackTimingReport() {
+    std::lock_guard<std::mutex> lock(mLock);
+    collectTimingStats();
+
+    std::string report;
+    char text[96];
+    for (int mode = 0; mode < 4; mode++) {
+        bool isRenderAhead = mode / 2;
+        bool isEnabled = mode % 2;
+        const TimingStats &stats = mTimingStats[isRenderAhead][isEnabled];
+        snprintf(text, sizeof(text), "%s, hint %s: xruns %lld, deadline misses %lld, ",
+                isRenderAhead ? "render-ahead" : "callback",
+                isEnabled ? "on" : "off",
+                static_cast<long long>(stats.xRuns),
+                static_cast<long long>(stats.deadlineMisses));
+        report += text;
+        if (isRenderAhead) {
+            snprintf(text, sizeof(text), "silence frames %lld, ",
+                    static_cast<long long>(stats.renderAheadSilenceFrames));
+            report += text;
+        }
+        report += "us:";
+
+        int64_t limit = DefaultDataCallback::kMinDurationMicros;
+        for (int i = 0; i < DefaultDataCallback::kDurationBucketCount; i++, limit *= 2) {
+            bool isLast = i == DefaultDataCallback::kDurationBucketCount - 1;
+            snprintf(text, sizeof(text), " %s%lld %lld", isLast ? ">=" : "<",
+                    static_cast<long long>(isLast ? limit / 2 : limit),
+                    static_cast<long long>(stats.durationHistogram[i]));
+            report += text;
+        }
+        report += mode == 3 ? "" : "; ";
+    }
+    return report;
+}
+
+SyncMetrics::Snapshot OboeEngine::getSyncMetrics() {
+    std::lock_guard<std::mutex> lock(mLock);
+    SyncMetrics metrics;
+    metrics.add(mSyncMetrics);
+    if (mAudioSource) metrics.add(mAudioSource->getSyncMetrics());
+    return metrics.getSnapshot();
+}
+
+std::string OboeEngine::getRenderCostReport() {
     std::lock_guard<std::mutex> lock(mLock);
-    if (mStream) {
-        mStream->stop();
-        mStream->close();
-        mStream.reset();
+    return mLatencyCallback->getGraphCostReport();
+}
+
+void OboeEngine::getCallbackStats(bool isPowerSaving, double& callbacksPerSecond, double& cpuMillsPerSecond) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    CallbackStats stats = mCallbackStats[isPowerSaving];
+    if (isPowerSaving == mIsPowerSaving && mStream) {
+        stats.callbackCount += mLatencyCallback->getCallbackCount();
+        stats.cpuTimeNanos += mLatencyCallback->getCpuTimeNanos();
+        stats.durationMills += millsNow() - mStreamStartMills;
     }
+
+    double seconds = stats.durationMills / 1000;
+    callbacksPerSecond = seconds > 0 ? stats.callbackCount / seconds : 0;
+    cpuMillsPerSecond = seconds > 0 ? stats.cpuTimeNanos / 1000000.0 / seconds : 0;
 }
@@ -18,11 +18,15 @@
 #define OBOE_ENGINE_H
 
 #include <oboe/Oboe.h>
+#include <condition_variable>
+#include <thread>
 
 #include "SoundGenerator.h"
 #include "LatencyTuningCallback.h"
 #include "IRestartable.h"
 #include "DefaultErrorCallback.h"
+#include "LatencyProfileStore.h"
+#include "PeerSync.h"
 
 class OboeEngine : public IRestartable {
 
@@ -43,7 +47,7 @@ public:
     void stop();
 
     // From IRestartable
-    void restart() override;
+    void restart(oboe::AudioStream *disconnectedStream) override;
 
     /**
      * Calculate the current latency between writing a frame to the output stream and
@@ -63,24 +67,194 @@ public:
     double getCurrentOutputLatencyMillis();
 
     int64_t getCurrentPositionMills();
-    int64_t getTotalPatchMills() { return mAudioSource->getTotalPatchMills(); }
+    /**
+     * @return patches of the playback over all the streams of this engine, @see SoundGenerator::getTotalPatchMills
+     */
+    int64_t getTotalPatchMills();
+
+    /**
+     * Set the compiled schedule to play, its frames must be the stream frames.
+     * @return false if its sample rate isn't the one of the stream
+     */
+    bool setTimeline(std::shared_ptr<Timeline> timeline);
+
+    /**
+     * Map the tracks of the timeline needed at the server time, so the playback starting there
+     * doesn't wait for them.
+     * @return false if there is no timeline or its tracks can't be mapped
+     */
+    bool prefetch(int64_t serverTimeMills);
 
-    void prepare(const std::string& filePath) { mAudioSource->prepare(filePath); }
-    void play(int64_t offsetMills, int64_t sizeMills) { mAudioSource->play(offsetMills, sizeMills); }
-    void setPlaybackShift(int64_t playbackShiftMills) { mAudioSource->setPlaybackShift(playbackShiftMills); }
+    /**
+     * Wait up to `kPlayLatencyWaitMills` for the stream to measure its latency, then pause it until
+     * play, so the stream opened in advance doesn't run silent low latency callbacks meanwhile.
+     * Play resumes it with the latency learned so far.
+     */
+    void standBy();
+
+    /**
+     * Start playing the timeline at the position scheduled for the server time. Waits up to
+     * `kPlayLatencyWaitMills` for the stream to measure its latency first, so the first buffer is
+     * already in sync. A stream started well before play doesn't wait.
+     */
+    void play(int64_t serverTimeMills);
+
+    /**
+     * @return timeline position scheduled for the server time or -1 without a timeline
+     */
+    int64_t getTimelinePositionMills(int64_t serverTimeMills);
+
+    void setPlaybackShift(int64_t playbackShiftMills);
+
+    /**
+     * Set the file where learned output latencies are persisted between the engine instances.
+     * Should be called before the engine is created.
+     */
+    static void setLatencyProfilePath(const std::string& filePath);
+
+    /**
+     * Set the `AudioDeviceInfo` type of the output the system currently plays to, which tells the
+     * routes apart in the latency profiles. Used by the streams opened afterwards.
+     */
+    static void setOutputRouteType(int32_t routeType);
+
+    /**
+     * Enable or disable aligning the playback to other devices in the local network.
+     * @see PeerSync
+     */
+    void setPeerSyncEnabled(bool isEnabled);
+    int32_t getPeerCount();
+
+    /**
+     * Switch between the low latency stream and the power saving one with large buffers.
+     *
+     * The new stream is opened next to the running one and continues the same timeline, the output
+     * is then cross-faded at a presentation time both streams are able to reach. @see handOver
+     */
+    void setPowerSavingEnabled(bool isEnabled);
+
+    /**
+     * Render the audio on a worker thread up to the given time ahead of the callbacks, 0 renders it
+     * in the callbacks. The playback is handed over to a new stream rendered the requested way,
+     * @see setPowerSavingEnabled
+     */
+    void setRenderAheadMills(int32_t renderAheadMills);
+
+    /**
+     * Burn the given fraction of the rendered audio duration in busy CPU time, in the callbacks or
+     * in the render-ahead worker. Used to benchmark both ways under load.
+     */
+    void setSyntheticLoad(double loadFraction);
+
+    /**
+     * Average callback rate and CPU time spent in the callbacks of the streams opened in the mode.
+     */
+    void getCallbackStats(bool isPowerSaving, double& callbacksPerSecond, double& cpuMillsPerSecond);
+
+    /**
+     * @return average processing time of every render graph node of the current stream
+     */
+    std::string getRenderCostReport();
+
+    /**
+     * Report the audio callback work duration to the system, @see PerformanceHintSession
+     */
+    void setPerformanceHintEnabled(bool isEnabled);
+
+    /**
+     * @return xruns, deadline misses and callback duration histogram with the performance hint
+     * disabled and enabled, with and without render-ahead
+     */
+    std::string getCallbackTimingReport();
+
+    /**
+     * @return synchronization errors, corrections and time in lock of the playback over all the
+     * streams of this engine
+     */
+    SyncMetrics::Snapshot getSyncMetrics();
 
 private:
-    oboe::Result createPlaybackStream();
+    struct CallbackStats {
+        int64_t callbackCount = 0;
+        int64_t cpuTimeNanos = 0;
+        double durationMills = 0;
+    };
+
+    struct TimingStats : DefaultDataCallback::TimingStats {
+        int64_t xRuns = 0;
+        int64_t renderAheadSilenceFrames = 0;
+    };
+
+    oboe::Result openStream(const std::shared_ptr<SoundGenerator>& previousSource = nullptr);
+    bool waitForLatency(double sinceMills);
+    oboe::Result createPlaybackStream(bool isPowerSaving,
+                                      LatencyTuningCallback *callback,
+                                      std::shared_ptr<oboe::AudioStream>& stream);
+    std::shared_ptr<RenderAheadBuffer> createRenderAhead(const std::shared_ptr<oboe::AudioStream>& stream,
+                                                         int32_t renderAheadMills);
+    std::shared_ptr<SoundGenerator> createAudioSource(const std::shared_ptr<oboe::AudioStream>& stream,
+                                                      const std::shared_ptr<RenderAheadBuffer>& renderAhead);
+    std::unique_ptr<LatencyProfileStore> collectLatencyProfile();
+    void saveLatencyProfile(std::unique_ptr<LatencyProfileStore> profiles);
+    bool hasMeasuredLatency();
+    void startPeerSync(int64_t sizeMills);
+
+    bool isHandoverRequested();
+    void requestHandover(std::unique_lock<std::mutex>& lock);
+    void runHandovers();
+    bool handOver(bool isPowerSaving, int32_t renderAheadMills);
+    void finishHandovers();
+    void closeIncomingStream(std::unique_lock<std::mutex>& lock);
+    void collectTimingStats();
 
     std::shared_ptr<oboe::AudioStream> mStream;
     std::unique_ptr<LatencyTuningCallback> mLatencyCallback;
     std::unique_ptr<DefaultErrorCallback> mErrorCallback;
     std::shared_ptr<SoundGenerator> mAudioSource;
+    std::shared_ptr<Timeline> mTimeline;
+
+    // The stream the playback is being handed over to
+    std::shared_ptr<oboe::AudioStream> mIncomingStream;
+    std::unique_ptr<LatencyTuningCallback> mIncomingCallback;
+    std::shared_ptr<SoundGenerator> mIncomingAudioSource;
+    double mIncomingStartMills = 0;
 
     int32_t        mChannelCount = oboe::Unspecified;
     int32_t        mSampleRate = oboe::kUnspecified;
 
+    LatencyProfileStore mLatencyProfileStore;
+    LatencyProfileKey mLatencyProfileKey;
+    std::mutex mLatencyProfileFileLock;
+    int64_t mSavedLatencyProfileVersion = 0; // guarded by mLatencyProfileFileLock
+
     std::mutex     mLock;
+
+    // Guarded by mLock
+    bool mIsPowerSaving = false;
+    bool mIsPowerSavingRequested = false;
+    int32_t mRenderAheadMills = 0;
+    int32_t mRenderAheadMillsRequested = 0;
+    double mSyntheticLoad = 0;
+    bool mIsHandoverRunning = false;
+    bool mIsHandoverCancelled = false;
+    bool mIsStopping = false;
+    bool mIsStandingBy = false;
+    std::thread mHandoverThread;
+    std::condition_variable mHandoverCondition;
+
+    CallbackStats mCallbackStats[2]; // indexed by the power saving mode
+    double mStreamStartMills = 0;
+
+    bool mIsPerformanceHintEnabled = false;
+    TimingStats mTimingStats[2][2]; // indexed by the render-ahead and the performance hint states
+    TimingStats mTimingBaseline; // values of the current callback and stream already collected
+
+    SyncMetrics mSyncMetrics; // of the sources already replaced
+    int64_t mReplacedPatchMills = 0;
+
+    // Guarded by mLock, PeerSync is started and stopped without it as its thread takes the lock
+    std::unique_ptr<PeerSync> mPeerSync;
+    bool mIsPeerSyncEnabled = false;
 };
 
 #endif //OBOE_ENGINE_H
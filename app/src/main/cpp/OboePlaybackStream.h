@@ -0,0 +1,30 @@
+#pragma once
+
+#include <oboe/Oboe.h>
+#include "IPlaybackStream.h"
+#include "utils.h"
+
+/**
+ * `IPlaybackStream` backed by an oboe stream and the steady clock.
+ */
+class OboePlaybackStream : public IPlaybackStream {
+public:
+    explicit OboePlaybackStream(std::shared_ptr<oboe::AudioStream> oboeStream)
+            : mStream(std::move(oboeStream)) {}
+
+    int32_t getSampleRate() const override { return mStream->getSampleRate(); }
+    int32_t getChannelCount() const override { return mStream->getChannelCount(); }
+    int64_t getFramesWritten() override { return mStream->getFramesWritten(); }
+
+    bool calculateLatencyMillis(double &latencyMills) override {
+        auto latencyResult = mStream->calculateLatencyMillis();
+        if (!latencyResult) return false;
+        latencyMills = latencyResult.value();
+        return true;
+    }
+
+    double nowMills() override { return preciseMillsNow(); }
+
+private:
+    const std::shared_ptr<oboe::AudioStream> mStream;
+};
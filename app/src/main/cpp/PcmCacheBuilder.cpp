@@ -0,0 +1,403 @@
+#include "PcmCacheBuilder.h"
+#include "logging_macros.h"
+#include "Trace.h"
+
+#include <media/NdkMediaCodec.h>
+#include <media/NdkMediaExtractor.h>
+#include <media/NdkMediaFormat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+
+// Compressed frames decoded before a segment and dropped, an MP3 frame may take its main data
+// from up to 511 bytes of the previous frames, which is a few frames at low bitrates
+static constexpr int32_t kPrimingFrames = 8;
+
+// More segments than threads, so threads finishing early have something to steal
+static constexpr int32_t kSegmentsPerThread = 4;
+static constexpr int32_t kMinSegmentFrames = 64;
+
+static constexpr int64_t kCodecTimeoutUs = 10000;
+// A segment fails if the codec neither takes input nor gives output for this long
+static constexpr auto kNoProgressTimeout = std::chrono::seconds(2);
+static constexpr int32_t kBytesPerSample = sizeof(int16_t);
+
+/**
+ * Segments of one thread, it takes them from the front and the others steal from the back.
+ */
+class PcmCacheBuilder::SegmentQueue {
+public:
+    void push(const Segment& segment) { mSegments.push_back(segment); }
+
+    bool pop(Segment& segment) {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mSegments.empty()) return false;
+        segment = mSegments.front();
+        mSegments.pop_front();
+        return true;
+    }
+
+    bool steal(Segment& segment) {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mSegments.empty()) return false;
+        segment = mSegments.back();
+        mSegments.pop_back();
+        return true;
+    }
+
+private:
+    std::mutex mLock;
+    std::deque<Segment> mSegments;
+};
+
+/**
+ * Extractor and codec of one thread. Every thread opens the asset on its own, so the extractors
+ * don't share a file offset.
+ */
+class PcmCacheBuilder::Decoder {
+public:
+    ~Decoder() {
+        if (mCodec != nullptr) {
+            AMediaCodec_stop(mCodec);
+            AMediaCodec_delete(mCodec);
+        }
+        if (mExtractor != nullptr) AMediaExtractor_delete(mExtractor);
+        if (mFd >= 0) close(mFd);
+        if (mAsset != nullptr) AAsset_close(mAsset);
+    }
+
+    bool open(AAssetManager *assetManager, const std::string& assetName, const char *mime) {
+        mAsset = AAssetManager_open(assetManager, assetName.c_str(), AASSET_MODE_UNKNOWN);
+        if (mAsset == nullptr) {
+            LOGE("PcmCacheBuilder: can't open %s", assetName.c_str());
+            return false;
+        }
+
+        off64_t start, length;
+        mFd = AAsset_openFileDescriptor64(mAsset, &start, &length);
+        if (mFd < 0) {
+            LOGE("PcmCacheBuilder: %s is compressed in the package", assetName.c_str());
+            return false;
+        }
+
+        mExtractor = AMediaExtractor_new();
+        if (AMediaExtractor_setDataSourceFd(mExtractor, mFd, start, length) != AMEDIA_OK
+                || AMediaExtractor_getTrackCount(mExtractor) == 0) {
+            LOGE("PcmCacheBuilder: can't extract %s", assetName.c_str());
+            return false;
+        }
+        AMediaExtractor_selectTrack(mExtractor, 0);
+
+        if (mime == nullptr) {
+            return true;
+        }
+
+        mCodec = AMediaCodec_createDecoderByType(mime);
+        AMediaFormat *format = AMediaExtractor_getTrackFormat(mExtractor, 0);
+        bool isStarted = mCodec != nullptr
+                && AMediaCodec_configure(mCodec, format, nullptr, nullptr, 0) == AMEDIA_OK
+                && AMediaCodec_start(mCodec) == AMEDIA_OK;
+        AMediaFormat_delete(format);
+        if (!isStarted) {
+            LOGE("PcmCacheBuilder: can't start a decoder for %s", mime);
+        }
+        return isStarted;
+    }
+
+    AMediaExtractor *getExtractor() { return mExtractor; }
+    AMediaCodec *getCodec() { return mCodec; }
+
+private:
+    AAsset *mAsset {nullptr};
+    int mFd {-1};
+    AMediaExtractor *mExtractor {nullptr};
+    AMediaCodec *mCodec {nullptr};
+};
+
+PcmCacheBuilder::PcmCacheBuilder(AAssetManager *assetManager, std::string assetName)
+        : mAssetManager(assetManager), mAssetName(std::move(assetName)) {}
+
+PcmCacheBuilder::~PcmCacheBuilder() = default;
+
+bool PcmCacheBuilder::build(const std::string& outputPath, int32_t threadCount) {
+    TRACE_SCOPE("PcmCacheBuilder::build");
+    auto startTime = std::chrono::steady_clock::now();
+
+    if (mFrameTimesUs.empty() && !scan()) {
+        return false;
+    }
+
+    if (threadCount <= 0) {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    auto frameCount = static_cast<int32_t>(mFrameTimesUs.size());
+    int32_t segmentCount = std::max(1, std::min(threadCount * kSegmentsPerThread, frameCount / kMinSegmentFrames));
+    threadCount = std::min(threadCount, segmentCount);
+
+    // Preallocate up to the end of the last frame, assuming it is as long as the one before
+    int64_t lastFrameUs = frameCount > 1 ? mFrameTimesUs[frameCount - 1] - mFrameTimesUs[frameCount - 2] : 0;
+    mOutputFrames = timeToFrames(mFrameTimesUs.back() + lastFrameUs) + 1;
+    int64_t frameBytes = mChannelCount * kBytesPerSample;
+
+    std::string tmpPath = outputPath + ".tmp";
+    int fd = open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || ftruncate(fd, mOutputFrames * frameBytes) != 0) {
+        LOGE("PcmCacheBuilder: can't allocate %s", tmpPath.c_str());
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    void *output = mmap(nullptr, mOutputFrames * frameBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (output == MAP_FAILED) {
+        LOGE("PcmCacheBuilder: can't map %s", tmpPath.c_str());
+        close(fd);
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    mOutput = static_cast<uint8_t*>(output);
+    mWrittenFrames = 0;
+    mIsFailed = false;
+
+    // Neighbouring segments go to the same thread, so it mostly reads the file forward
+    mQueues.clear();
+    for (int32_t i = 0; i < threadCount; ++i) {
+        mQueues.emplace_back(new SegmentQueue());
+    }
+    for (int32_t i = 0; i < segmentCount; ++i) {
+        Segment segment {
+                static_cast<int32_t>(int64_t(frameCount) * i / segmentCount),
+                static_cast<int32_t>(int64_t(frameCount) * (i + 1) / segmentCount)
+        };
+        mQueues[int64_t(i) * threadCount / segmentCount]->push(segment);
+    }
+
+    std::vector<std::thread> threads;
+    for (int32_t i = 1; i < threadCount; ++i) {
+        threads.emplace_back(&PcmCacheBuilder::runWorker, this, i);
+    }
+    runWorker(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    munmap(mOutput, mOutputFrames * frameBytes);
+    mOutput = nullptr;
+
+    bool isOk = !mIsFailed
+            && ftruncate(fd, mWrittenFrames * frameBytes) == 0
+            && fsync(fd) == 0;
+    isOk &= close(fd) == 0;
+    isOk = isOk && rename(tmpPath.c_str(), outputPath.c_str()) == 0;
+    if (!isOk) {
+        LOGE("PcmCacheBuilder: failed to build %s", outputPath.c_str());
+        unlink(tmpPath.c_str());
+        return false;
+    }
+
+    mBuildMills = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+    LOGI("PcmCacheBuilder: %lld frames of %d Hz, %d channels in %.0f ms on %d threads",
+         static_cast<long long>(mWrittenFrames.load()), mSampleRate, mChannelCount, mBuildMills, threadCount);
+    return true;
+}
+
+std::string PcmCacheBuilder::benchmark(const std::string& scratchPath) {
+    std::string report;
+    int32_t coreCount = std::max(1u, std::thread::hardware_concurrency());
+    for (int32_t threadCount = 1;; threadCount = std::min(threadCount * 2, coreCount)) {
+        char line[64];
+        if (build(scratchPath, threadCount)) {
+            snprintf(line, sizeof(line), "threads: %d, time to ready: %.0f ms\n", threadCount, mBuildMills);
+        } else {
+            snprintf(line, sizeof(line), "threads: %d, failed\n", threadCount);
+        }
+        report += line;
+        if (threadCount == coreCount) break;
+    }
+    unlink(scratchPath.c_str());
+    return report;
+}
+
+bool PcmCacheBuilder::scan() {
+    TRACE_SCOPE("PcmCacheBuilder::scan");
+    Decoder decoder;
+    if (!decoder.open(mAssetManager, mAssetName, nullptr)) {
+        return false;
+    }
+    AMediaExtractor *extractor = decoder.getExtractor();
+
+    AMediaFormat *format = AMediaExtractor_getTrackFormat(extractor, 0);
+    const char *mime = nullptr;
+    bool hasFormat = AMediaFormat_getString(format, AMEDIAFORMAT_KEY_MIME, &mime)
+            && AMediaFormat_getInt32(format, AMEDIAFORMAT_KEY_SAMPLE_RATE, &mSampleRate)
+            && AMediaFormat_getInt32(format, AMEDIAFORMAT_KEY_CHANNEL_COUNT, &mChannelCount);
+    if (hasFormat) mMime = mime;
+    AMediaFormat_delete(format);
+    if (!hasFormat || mSampleRate <= 0 || mChannelCount <= 0) {
+        LOGE("PcmCacheBuilder: unknown format of %s", mAssetName.c_str());
+        return false;
+    }
+
+    for (int64_t timeUs; (timeUs = AMediaExtractor_getSampleTime(extractor)) >= 0;) {
+        mFrameTimesUs.push_back(timeUs);
+        if (!AMediaExtractor_advance(extractor)) break;
+    }
+    if (mFrameTimesUs.empty()) {
+        LOGE("PcmCacheBuilder: no frames in %s", mAssetName.c_str());
+        return false;
+    }
+    return true;
+}
+
+void PcmCacheBuilder::runWorker(int32_t worker) {
+    TRACE_SCOPE("PcmCacheBuilder::runWorker");
+    Decoder decoder;
+    if (!decoder.open(mAssetManager, mAssetName, mMime.c_str())) {
+        mIsFailed = true;
+        return;
+    }
+
+    auto queueCount = static_cast<int32_t>(mQueues.size());
+    Segment segment;
+    while (!mIsFailed) {
+        bool hasSegment = mQueues[worker]->pop(segment);
+        for (int32_t i = 1; !hasSegment && i < queueCount; ++i) {
+            hasSegment = mQueues[(worker + i) % queueCount]->steal(segment);
+        }
+        if (!hasSegment) {
+            break;
+        }
+        if (!decodeSegment(decoder, segment)) {
+            mIsFailed = true;
+        }
+    }
+}
+
+bool PcmCacheBuilder::decodeSegment(Decoder& decoder, const Segment& segment) {
+    TRACE_SCOPE("PcmCacheBuilder::decodeSegment");
+    AMediaExtractor *extractor = decoder.getExtractor();
+    AMediaCodec *codec = decoder.getCodec();
+
+    int64_t primeUs = mFrameTimesUs[std::max(0, segment.firstFrame - kPrimingFrames)];
+    int64_t firstUs = mFrameTimesUs[segment.firstFrame];
+    bool isLast = segment.endFrame == static_cast<int32_t>(mFrameTimesUs.size());
+    int64_t endUs = isLast ? INT64_MAX : mFrameTimesUs[segment.endFrame];
+
+    // Only frames from here on are written, neighbouring segments meet exactly at the frame time
+    int64_t begin = timeToFrames(firstUs);
+    int64_t end = isLast ? mOutputFrames : timeToFrames(endUs);
+    // The end of the last segment is only estimated, it must reach at least its last frame
+    int64_t requiredEnd = isLast ? timeToFrames(mFrameTimesUs.back()) : end;
+    int64_t coveredEnd = begin;
+
+    // Seeking may be approximate without a seek table, so step back until it is before the priming
+    for (int64_t seekUs = primeUs;; seekUs = std::max<int64_t>(0, seekUs - 1000000)) {
+        AMediaExtractor_seekTo(extractor, seekUs, AMEDIAEXTRACTOR_SEEK_PREVIOUS_SYNC);
+        int64_t timeUs = AMediaExtractor_getSampleTime(extractor);
+        if (timeUs < 0 || timeUs <= primeUs || seekUs == 0) break;
+    }
+    AMediaCodec_flush(codec);
+
+    bool isInputDone = false;
+    auto progressTime = std::chrono::steady_clock::now();
+    for (;;) {
+        if (std::chrono::steady_clock::now() - progressTime > kNoProgressTimeout) {
+            LOGE("PcmCacheBuilder: decoder stalled in frames [%lld, %lld)",
+                 static_cast<long long>(begin), static_cast<long long>(end));
+            return false;
+        }
+
+        if (!isInputDone) {
+            ssize_t index = AMediaCodec_dequeueInputBuffer(codec, kCodecTimeoutUs);
+            if (index >= 0) {
+                size_t capacity;
+                uint8_t *buffer = AMediaCodec_getInputBuffer(codec, index, &capacity);
+
+                int64_t timeUs;
+                ssize_t size = 0;
+                while ((timeUs = AMediaExtractor_getSampleTime(extractor)) >= 0 && timeUs < primeUs) {
+                    AMediaExtractor_advance(extractor);
+                }
+                isInputDone = timeUs < 0 || timeUs >= endUs;
+                if (!isInputDone) {
+                    size = AMediaExtractor_readSampleData(extractor, buffer, capacity);
+                    AMediaExtractor_advance(extractor);
+                }
+                AMediaCodec_queueInputBuffer(codec, index, 0, std::max<ssize_t>(size, 0),
+                                             isInputDone ? 0 : timeUs,
+                                             isInputDone ? AMEDIACODEC_BUFFER_FLAG_END_OF_STREAM : 0);
+                progressTime = std::chrono::steady_clock::now();
+            }
+        }
+
+        AMediaCodecBufferInfo info;
+        ssize_t index = AMediaCodec_dequeueOutputBuffer(codec, &info, kCodecTimeoutUs);
+        if (index == AMEDIACODEC_INFO_OUTPUT_FORMAT_CHANGED) {
+            progressTime = std::chrono::steady_clock::now();
+            AMediaFormat *format = AMediaCodec_getOutputFormat(codec);
+            int32_t sampleRate = 0;
+            int32_t channelCount = 0;
+            AMediaFormat_getInt32(format, AMEDIAFORMAT_KEY_SAMPLE_RATE, &sampleRate);
+            AMediaFormat_getInt32(format, AMEDIAFORMAT_KEY_CHANNEL_COUNT, &channelCount);
+            AMediaFormat_delete(format);
+            if (sampleRate != mSampleRate || channelCount != mChannelCount) {
+                LOGE("PcmCacheBuilder: decoder output %d Hz, %d channels differs from the track",
+                     sampleRate, channelCount);
+                return false;
+            }
+        } else if (index >= 0) {
+            size_t capacity;
+            uint8_t *buffer = AMediaCodec_getOutputBuffer(codec, index, &capacity);
+            int64_t frameBytes = mChannelCount * kBytesPerSample;
+            bool isWritten = writeFrames(timeToFrames(info.presentationTimeUs), buffer + info.offset,
+                                         info.size / frameBytes, begin, end, coveredEnd);
+            AMediaCodec_releaseOutputBuffer(codec, index, false);
+            progressTime = std::chrono::steady_clock::now();
+            if (!isWritten) {
+                return false;
+            }
+            if (info.flags & AMEDIACODEC_BUFFER_FLAG_END_OF_STREAM) {
+                if (coveredEnd < requiredEnd) {
+                    LOGE("PcmCacheBuilder: frames [%lld, %lld) are missing from the decoder output",
+                         static_cast<long long>(coveredEnd), static_cast<long long>(requiredEnd));
+                    return false;
+                }
+                return !mIsFailed;
+            }
+        } else if (mIsFailed) {
+            return false;
+        }
+    }
+}
+
+bool PcmCacheBuilder::writeFrames(int64_t position, const uint8_t *data, int64_t numFrames,
+                                  int64_t begin, int64_t end, int64_t& coveredEnd) {
+    int64_t first = std::max(position, begin);
+    int64_t last = std::min(position + numFrames, end);
+    if (first >= last) {
+        return true;
+    }
+    if (first > coveredEnd) {
+        LOGE("PcmCacheBuilder: decoder output skips frames [%lld, %lld)",
+             static_cast<long long>(coveredEnd), static_cast<long long>(first));
+        return false;
+    }
+    coveredEnd = std::max(coveredEnd, last);
+
+    int64_t frameBytes = mChannelCount * kBytesPerSample;
+    memcpy(mOutput + first * frameBytes, data + (first - position) * frameBytes, (last - first) * frameBytes);
+
+    int64_t writtenFrames = mWrittenFrames;
+    while (last > writtenFrames && !mWrittenFrames.compare_exchange_weak(writtenFrames, last)) {}
+    return true;
+}
+
+int64_t PcmCacheBuilder::timeToFrames(int64_t timeUs) const {
+    return (timeUs * mSampleRate + 500000) / 1000000;
+}
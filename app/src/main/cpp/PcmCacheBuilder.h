@@ -0,0 +1,78 @@
+#pragma once
+
+#include <android/asset_manager.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Decodes a compressed asset into a raw I16 PCM file, the playback cache, on all cores.
+ *
+ * The compressed stream is split at frame boundaries into segments decoded independently by
+ * per-thread decoders, idle threads steal segments from the busy ones. Every segment is decoded
+ * starting `kPrimingFrames` earlier and the output of those frames is dropped, which primes the
+ * bit reservoir and the overlap-add state. Decoded frames are written straight into a preallocated
+ * memory-mapped file at the offset of their presentation time. A segment whose output doesn't cover
+ * its frames contiguously, or whose decoder stalls, fails the build, so the caller can fall back.
+ */
+class PcmCacheBuilder {
+public:
+    PcmCacheBuilder(AAssetManager *assetManager, std::string assetName);
+    ~PcmCacheBuilder();
+
+    /**
+     * @param threadCount number of decoding threads, 0 for one per core
+     * @return false if decoding failed, outputPath is left untouched then
+     */
+    bool build(const std::string& outputPath, int32_t threadCount = 0);
+
+    /**
+     * Build into scratchPath with 1, 2, 4... threads up to the number of cores and remove it.
+     * @return time to ready per thread count
+     */
+    std::string benchmark(const std::string& scratchPath);
+
+    int32_t getSampleRate() const { return mSampleRate; }
+    int32_t getChannelCount() const { return mChannelCount; }
+    double getBuildMills() const { return mBuildMills; }
+
+private:
+    struct Segment {
+        int32_t firstFrame;
+        int32_t endFrame;
+    };
+
+    class Decoder;
+    class SegmentQueue;
+
+    bool scan();
+    void runWorker(int32_t worker);
+    bool decodeSegment(Decoder& decoder, const Segment& segment);
+    /**
+     * Write the decoded frames which fall into [begin, end) and extend coveredEnd, the end of the
+     * frames written contiguously from begin.
+     * @return false if the frames would leave a hole after coveredEnd
+     */
+    bool writeFrames(int64_t position, const uint8_t *data, int64_t numFrames,
+                     int64_t begin, int64_t end, int64_t& coveredEnd);
+    int64_t timeToFrames(int64_t timeUs) const;
+
+    AAssetManager *mAssetManager;
+    const std::string mAssetName;
+
+    std::string mMime;
+    int32_t mSampleRate {0};
+    int32_t mChannelCount {0};
+    std::vector<int64_t> mFrameTimesUs;
+
+    std::vector<std::unique_ptr<SegmentQueue>> mQueues;
+
+    uint8_t *mOutput {nullptr};
+    int64_t mOutputFrames {0};
+    std::atomic<int64_t> mWrittenFrames {0};
+    std::atomic_bool mIsFailed {false};
+
+    double mBuildMills {0};
+};
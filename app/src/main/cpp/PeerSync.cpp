@@ -0,0 +1,326 @@
+#include "PeerSync.h"
+#include "logging_macros.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cmath>
+#include <cstring>
+#include <endian.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <random>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static constexpr const char *kGroupAddress = "239.255.77.77";
+static constexpr uint16_t kPort = 47077;
+
+static constexpr uint32_t kPacketMagic = 0x50464d32; // "PFM2", version 1 had no echoes
+// Header followed by the echoes of the reference
+static constexpr size_t kHeaderSize = 44;
+static constexpr size_t kEchoSize = 24;
+static constexpr size_t kMaxEchoes = 8;
+static constexpr size_t kMaxPacketSize = kHeaderSize + kMaxEchoes * kEchoSize;
+
+static constexpr size_t kMaxPeers = 64;
+static constexpr double kMinSendIntervalMills = 250;
+static constexpr double kMaxGroupPacketsPerSecond = 20;
+static constexpr double kPeerTimeoutIntervals = 4;
+static constexpr double kMaxPollMills = 100;
+
+// A peer which is further away than that is rather broken than slightly off, so it isn't followed
+static constexpr int64_t kMaxShiftMills = 1000;
+
+constexpr int PeerSync::kOffsetWindow;
+
+static uint64_t generatePeerId() {
+    std::random_device device;
+    std::mt19937_64 generator((static_cast<uint64_t>(device()) << 32) ^ device() ^ static_cast<uint64_t>(millsNow()));
+    return generator();
+}
+
+static int64_t microsNow() {
+    return llround(preciseMillsNow() * 1000);
+}
+
+static void put32(uint8_t *data, uint32_t value) {
+    value = htonl(value);
+    memcpy(data, &value, 4);
+}
+
+static void put64(uint8_t *data, uint64_t value) {
+    value = htobe64(value);
+    memcpy(data, &value, 8);
+}
+
+static uint32_t get32(const uint8_t *data) {
+    uint32_t value;
+    memcpy(&value, data, 4);
+    return ntohl(value);
+}
+
+static uint64_t get64(const uint8_t *data) {
+    uint64_t value;
+    memcpy(&value, data, 8);
+    return be64toh(value);
+}
+
+/**
+ * @return difference of two loop positions mapped to (-sizeMills / 2, sizeMills / 2]
+ */
+static int64_t wrapOffset(int64_t offsetMills, int64_t sizeMills) {
+    offsetMills %= sizeMills;
+    if (offsetMills > sizeMills / 2) offsetMills -= sizeMills;
+    if (offsetMills <= -sizeMills / 2) offsetMills += sizeMills;
+    return offsetMills;
+}
+
+PeerSync::PeerSync(PositionProvider positionProvider, ShiftListener shiftListener)
+        : mPositionProvider(std::move(positionProvider))
+        , mShiftListener(std::move(shiftListener))
+        , mId(generatePeerId()) {
+    mPeers.reserve(kMaxPeers);
+}
+
+PeerSync::~PeerSync() {
+    stop();
+}
+
+bool PeerSync::start(int64_t sizeMills) {
+    if (mIsRunning || sizeMills <= 0) return false;
+    mSizeMills = sizeMills;
+
+    mSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (mSocket < 0) {
+        LOGE("PeerSync: can't create socket");
+        return false;
+    }
+
+    // Several processes on the same host may join the group, e.g. when testing on loopback
+    int enabled = 1;
+    setsockopt(mSocket, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled));
+#ifdef SO_REUSEPORT
+    setsockopt(mSocket, SOL_SOCKET, SO_REUSEPORT, &enabled, sizeof(enabled));
+#endif
+    unsigned char loop = 1;
+    setsockopt(mSocket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(kPort);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    ip_mreq membership {};
+    membership.imr_multiaddr.s_addr = inet_addr(kGroupAddress);
+    membership.imr_interface.s_addr = htonl(INADDR_ANY);
+
+    if (bind(mSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0
+            || setsockopt(mSocket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0) {
+        LOGE("PeerSync: can't join multicast group");
+        close(mSocket);
+        mSocket = -1;
+        return false;
+    }
+
+    mPeers.clear();
+    mPeerCount = 0;
+    mIsReference = true;
+    mShiftMills = 0;
+    mRoundTripMills = -1;
+
+    mIsRunning = true;
+    mThread = std::thread(&PeerSync::run, this);
+    LOGD("PeerSync started: id = %llx", static_cast<unsigned long long>(mId));
+    return true;
+}
+
+void PeerSync::stop() {
+    if (!mIsRunning.exchange(false)) return;
+
+    mThread.join();
+    close(mSocket);
+    mSocket = -1;
+    LOGD("PeerSync stopped");
+}
+
+void PeerSync::run() {
+    double nextSendMills = millsNow();
+
+    while (mIsRunning) {
+        double nowMills = millsNow();
+        if (nowMills >= nextSendMills) {
+            sendPosition();
+
+            // Jitter the interval, so peers started at the same moment don't send in bursts
+            double intervalMills = getSendIntervalMills();
+            nextSendMills = nowMills + intervalMills * (0.9 + 0.2 * (mSequence % 11) / 10.0);
+        }
+
+        pollfd descriptor { mSocket, POLLIN, 0 };
+        int timeoutMills = static_cast<int>(std::min(kMaxPollMills, std::max(0.0, nextSendMills - nowMills)));
+        if (poll(&descriptor, 1, timeoutMills) > 0 && (descriptor.revents & POLLIN)) {
+            receivePositions();
+        }
+
+        removeExpiredPeers();
+        updateShift();
+    }
+}
+
+void PeerSync::sendPosition() {
+    int64_t positionMills = mPositionProvider();
+    if (positionMills < 0) return;
+
+    // Peers align to the position we actually target, including our own correction
+    positionMills = wrapOffset(positionMills + mShiftMills, mSizeMills);
+    if (positionMills < 0) positionMills += mSizeMills;
+
+    int64_t nowMicros = microsNow();
+    uint8_t packet[kMaxPacketSize];
+    put32(packet, kPacketMagic);
+    put32(packet + 4, ++mSequence);
+    put64(packet + 8, mId);
+    put64(packet + 16, static_cast<uint64_t>(nowMicros));
+    put64(packet + 24, static_cast<uint64_t>(positionMills));
+    put64(packet + 32, static_cast<uint64_t>(mSizeMills));
+
+    // Only the reference echoes, the peers measure the round trip to it alone
+    size_t echoCount = mIsReference ? std::min(kMaxEchoes, mPeers.size()) : 0;
+    for (size_t i = 0; i < echoCount; i++) {
+        const Peer& peer = mPeers[(mEchoIndex + i) % mPeers.size()];
+        uint8_t *echo = packet + kHeaderSize + i * kEchoSize;
+        put64(echo, peer.id);
+        put64(echo + 8, static_cast<uint64_t>(peer.lastSendMicros));
+        put64(echo + 16, static_cast<uint64_t>(nowMicros - llround(peer.lastSeenMills * 1000)));
+    }
+    if (echoCount > 0) mEchoIndex = (mEchoIndex + echoCount) % mPeers.size();
+    put32(packet + 40, static_cast<uint32_t>(echoCount));
+
+    sockaddr_in group {};
+    group.sin_family = AF_INET;
+    group.sin_port = htons(kPort);
+    group.sin_addr.s_addr = inet_addr(kGroupAddress);
+
+    size_t size = kHeaderSize + echoCount * kEchoSize;
+    if (sendto(mSocket, packet, size, 0, reinterpret_cast<sockaddr*>(&group), sizeof(group)) < 0) {
+        LOGW("PeerSync: send failed");
+    }
+}
+
+void PeerSync::receivePositions() {
+    uint8_t packet[kMaxPacketSize];
+
+    ssize_t size;
+    while ((size = recv(mSocket, packet, sizeof(packet), MSG_DONTWAIT)) >= 0) {
+        if (size < static_cast<ssize_t>(kHeaderSize)) continue;
+        if (get32(packet) != kPacketMagic) continue;
+        if (static_cast<int64_t>(get64(packet + 32)) != mSizeMills) continue;
+
+        size_t echoCount = get32(packet + 40);
+        if (echoCount > kMaxEchoes || static_cast<size_t>(size) != kHeaderSize + echoCount * kEchoSize) continue;
+
+        uint64_t id = get64(packet + 8);
+        if (id == mId) continue; // our own packet looped back
+
+        onPosition(id, get32(packet + 4),
+                static_cast<int64_t>(get64(packet + 16)),
+                static_cast<int64_t>(get64(packet + 24)));
+
+        for (size_t i = 0; i < echoCount; i++) {
+            const uint8_t *echo = packet + kHeaderSize + i * kEchoSize;
+            if (get64(echo) != mId) continue;
+            onEcho(id, Echo { mId, static_cast<int64_t>(get64(echo + 8)), static_cast<int64_t>(get64(echo + 16)) });
+        }
+    }
+}
+
+void PeerSync::onPosition(uint64_t peerId, uint32_t sequence, int64_t peerMonotonicMicros, int64_t peerPositionMills) {
+    int64_t positionMills = mPositionProvider();
+    if (positionMills < 0) return;
+
+    double nowMills = preciseMillsNow();
+
+    auto peer = std::find_if(mPeers.begin(), mPeers.end(), [peerId](const Peer& p) { return p.id == peerId; });
+    if (peer == mPeers.end()) {
+        if (mPeers.size() >= kMaxPeers) return;
+        mPeers.push_back(Peer { peerId, sequence - 1, nowMills, peerMonotonicMicros, {}, 0, 0, {}, 0, 0 });
+        peer = mPeers.end() - 1;
+        LOGD("PeerSync: peer joined: %llx", static_cast<unsigned long long>(peerId));
+    }
+
+    // Drop reordered and duplicated packets
+    if (static_cast<int32_t>(sequence - peer->sequence) <= 0) return;
+
+    peer->sequence = sequence;
+    peer->lastSeenMills = nowMills;
+    peer->lastSendMicros = peerMonotonicMicros;
+    peer->samples[peer->sampleIndex] = Sample { nowMills - peerMonotonicMicros / 1000.0,
+            wrapOffset(peerPositionMills - positionMills, mSizeMills) };
+    peer->sampleIndex = (peer->sampleIndex + 1) % kOffsetWindow;
+    peer->sampleCount = std::min(peer->sampleCount + 1, kOffsetWindow);
+
+    mPeerCount = static_cast<int32_t>(mPeers.size());
+}
+
+/**
+ * The peer has echoed our packet: the round trip is the time since we sent it, less the time the
+ * peer held it.
+ */
+void PeerSync::onEcho(uint64_t peerId, const Echo& echo) {
+    double roundTripMills = (microsNow() - echo.sendMicros - echo.holdMicros) / 1000.0;
+    if (roundTripMills < 0) return;
+
+    auto peer = std::find_if(mPeers.begin(), mPeers.end(), [peerId](const Peer& p) { return p.id == peerId; });
+    if (peer == mPeers.end()) return;
+
+    peer->roundTrips[peer->roundTripIndex] = roundTripMills;
+    peer->roundTripIndex = (peer->roundTripIndex + 1) % kOffsetWindow;
+    peer->roundTripCount = std::min(peer->roundTripCount + 1, kOffsetWindow);
+}
+
+void PeerSync::removeExpiredPeers() {
+    double expiredMills = millsNow() - getSendIntervalMills() * kPeerTimeoutIntervals;
+    auto it = std::remove_if(mPeers.begin(), mPeers.end(), [expiredMills](const Peer& p) { return p.lastSeenMills < expiredMills; });
+    if (it == mPeers.end()) return;
+
+    mPeers.erase(it, mPeers.end());
+    mPeerCount = static_cast<int32_t>(mPeers.size());
+}
+
+void PeerSync::updateShift() {
+    auto reference = std::min_element(mPeers.begin(), mPeers.end(), [](const Peer& a, const Peer& b) { return a.id < b.id; });
+
+    int64_t shiftMills = 0;
+    double roundTripMills = -1;
+    mIsReference = reference == mPeers.end() || mId < reference->id;
+
+    if (!mIsReference && reference->sampleCount > 0) {
+        // The sample which has spent the least time in the network is the most accurate one
+        auto begin = reference->samples.begin();
+        auto best = std::min_element(begin, begin + reference->sampleCount,
+                [](const Sample& a, const Sample& b) { return a.delayMills < b.delayMills; });
+
+        // It has taken about half of the shortest round trip, the reference has played on meanwhile
+        if (reference->roundTripCount > 0) {
+            roundTripMills = *std::min_element(reference->roundTrips.begin(),
+                                               reference->roundTrips.begin() + reference->roundTripCount);
+        }
+        int64_t offsetMills = wrapOffset(best->offsetMills + llround(std::max(0.0, roundTripMills) / 2), mSizeMills);
+
+        if (abs(offsetMills) <= kMaxShiftMills) {
+            shiftMills = offsetMills;
+        }
+    }
+    mRoundTripMills = roundTripMills;
+
+    if (mShiftMills.exchange(shiftMills) != shiftMills) {
+        LOGD("PeerSync: shift: %lld; round trip: %.1f; reference: %s", static_cast<long long>(shiftMills), roundTripMills,
+                mIsReference ? "true" : "false");
+        mShiftListener(shiftMills);
+    }
+}
+
+double PeerSync::getSendIntervalMills() {
+    return std::max(kMinSendIntervalMills, (mPeers.size() + 1) * 1000.0 / kMaxGroupPacketsPerSecond);
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+/**
+ * Aligns the playback of devices standing in the same local network.
+ *
+ * Every device periodically multicasts its (monotonic time, target playback position) pair over UDP.
+ * The peer with the lowest id is elected as a reference, all other peers estimate their offset
+ * against it and report it as an extra playback shift. This removes the difference between
+ * the server offsets each device has got from its own time source.
+ *
+ * A position has advanced by the network delay once it is received, which on Wi-Fi with power
+ * saving buffering reaches tens of milliseconds. The reference echoes the last packet of every peer,
+ * in turns, with the time it held it, so each peer measures its round trip to the reference the way
+ * NTP does and adds half of the shortest one to the offset.
+ *
+ * The send interval grows with the number of peers, so the packet rate of the whole group is bounded.
+ */
+class PeerSync {
+public:
+    /**
+     * Returns the target playback position without the peer shift, or -1 if nothing is played.
+     */
+    using PositionProvider = std::function<int64_t()>;
+
+    using ShiftListener = std::function<void(int64_t shiftMills)>;
+
+    PeerSync(PositionProvider positionProvider, ShiftListener shiftListener);
+    ~PeerSync();
+
+    /**
+     * Join the multicast group and start exchanging positions.
+     *
+     * @param sizeMills length of the played loop, only peers playing the same loop are aligned
+     * @return false if the socket can't be opened
+     */
+    bool start(int64_t sizeMills);
+    void stop();
+
+    int32_t getPeerCount() { return mPeerCount; }
+    bool isReference() { return mIsReference; }
+    int64_t getShiftMills() { return mShiftMills; }
+
+    /**
+     * @return shortest recent round trip to the reference, -1 if not measured yet or the reference
+     */
+    double getRoundTripMills() { return mRoundTripMills; }
+
+private:
+    static constexpr int kOffsetWindow = 8;
+
+    struct Sample {
+        double delayMills; // receive time minus peer send time, only relative values are meaningful
+        int64_t offsetMills;
+    };
+
+    struct Peer {
+        uint64_t id;
+        uint32_t sequence;
+        double lastSeenMills;
+        int64_t lastSendMicros; // in the peer time base, echoed back while we are the reference
+        std::array<Sample, kOffsetWindow> samples;
+        int32_t sampleCount;
+        int32_t sampleIndex;
+        std::array<double, kOffsetWindow> roundTrips;
+        int32_t roundTripCount;
+        int32_t roundTripIndex;
+    };
+
+    struct Echo {
+        uint64_t peerId;
+        int64_t sendMicros;
+        int64_t holdMicros;
+    };
+
+    void run();
+    void sendPosition();
+    void receivePositions();
+    void onPosition(uint64_t peerId, uint32_t sequence, int64_t peerMonotonicMicros, int64_t peerPositionMills);
+    void onEcho(uint64_t peerId, const Echo& echo);
+    void removeExpiredPeers();
+    void updateShift();
+    double getSendIntervalMills();
+
+    const PositionProvider mPositionProvider;
+    const ShiftListener mShiftListener;
+
+    const uint64_t mId;
+    uint32_t mSequence = 0;
+    size_t mEchoIndex = 0;
+    int64_t mSizeMills = 0;
+    int mSocket = -1;
+
+    std::vector<Peer> mPeers; // accessed from the worker thread only
+
+    std::thread mThread;
+    std::atomic_bool mIsRunning {false};
+
+    std::atomic_int32_t mPeerCount {0};
+    std::atomic_bool mIsReference {true};
+    std::atomic_int64_t mShiftMills {0};
+    std::atomic<double> mRoundTripMills {-1};
+};
@@ -0,0 +1,251 @@
+#include "PerformanceHint.h"
+#include "logging_macros.h"
+
+#include <chrono>
+
+#ifdef __ANDROID__
+
+#include <dlfcn.h>
+
+namespace {
+
+// The NDK only declares APerformanceHint since API 33, while the app supports API 24
+struct APerformanceHintManager;
+struct APerformanceHintSession;
+
+using GetManagerFunction = APerformanceHintManager *(*)();
+using CreateSessionFunction = APerformanceHintSession *(*)(APerformanceHintManager *, const int32_t *, size_t, int64_t);
+using UpdateTargetFunction = int (*)(APerformanceHintSession *, int64_t);
+using ReportActualFunction = int (*)(APerformanceHintSession *, int64_t);
+using CloseSessionFunction = void (*)(APerformanceHintSession *);
+
+struct HintFunctions {
+    GetManagerFunction getManager {nullptr};
+    CreateSessionFunction createSession {nullptr};
+    UpdateTargetFunction updateTarget {nullptr};
+    ReportActualFunction reportActual {nullptr};
+    CloseSessionFunction closeSession {nullptr};
+
+    bool isLoaded() const {
+        return getManager && createSession && updateTarget && reportActual && closeSession;
+    }
+};
+
+HintFunctions loadHintFunctions() {
+    HintFunctions functions;
+    void *library = dlopen("libandroid.so", RTLD_NOW | RTLD_NOLOAD);
+    if (library) {
+        functions.getManager = reinterpret_cast<GetManagerFunction>(dlsym(library, "APerformanceHint_getManager"));
+        functions.createSession = reinterpret_cast<CreateSessionFunction>(dlsym(library, "APerformanceHint_createSession"));
+        functions.updateTarget = reinterpret_cast<UpdateTargetFunction>(dlsym(library, "APerformanceHint_updateTargetWorkDuration"));
+        functions.reportActual = reinterpret_cast<ReportActualFunction>(dlsym(library, "APerformanceHint_reportActualWorkDuration"));
+        functions.closeSession = reinterpret_cast<CloseSessionFunction>(dlsym(library, "APerformanceHint_closeSession"));
+    }
+    return functions;
+}
+
+const HintFunctions& getHintFunctions() {
+    static const HintFunctions functions = loadHintFunctions();
+    return functions;
+}
+
+class AdpfSession : public PerformanceHintSession {
+public:
+    explicit AdpfSession(APerformanceHintSession *session) : mSession(session) {}
+
+    ~AdpfSession() override {
+        getHintFunctions().closeSession(mSession);
+    }
+
+    void updateTargetWorkDuration(int64_t targetNanos) override {
+        getHintFunctions().updateTarget(mSession, targetNanos);
+    }
+
+    void reportActualWorkDuration(int64_t actualNanos) override {
+        getHintFunctions().reportActual(mSession, actualNanos);
+    }
+
+private:
+    APerformanceHintSession *mSession;
+};
+
+} // namespace
+
+std::unique_ptr<PerformanceHintSession> PerformanceHintSession::open(const std::vector<int32_t>& threadIds, int64_t targetNanos) {
+    const HintFunctions& functions = getHintFunctions();
+    if (!functions.isLoaded()) {
+        LOGD("Performance hints are not supported");
+        return nullptr;
+    }
+
+    APerformanceHintManager *manager = functions.getManager();
+    APerformanceHintSession *session = manager
+            ? functions.createSession(manager, threadIds.data(), threadIds.size(), targetNanos) : nullptr;
+    if (!session) {
+        LOGW("Error creating performance hint session");
+        return nullptr;
+    }
+    LOGD("Performance hint session opened for %d threads, target %lld ns",
+         static_cast<int>(threadIds.size()), static_cast<long long>(targetNanos));
+    return std::make_unique<AdpfSession>(session);
+}
+
+#else
+
+namespace {
+
+class LoggingSession : public PerformanceHintSession {
+public:
+    LoggingSession(const std::vector<int32_t>& threadIds, int64_t targetNanos) {
+        LOGD("Performance hint session opened for %d threads, target %lld ns",
+             static_cast<int>(threadIds.size()), static_cast<long long>(targetNanos));
+    }
+
+    ~LoggingSession() override {
+        LOGD("Performance hint session closed after %lld reports", static_cast<long long>(mReportCount));
+    }
+
+    void updateTargetWorkDuration(int64_t targetNanos) override {
+        LOGD("Performance hint target %lld ns", static_cast<long long>(targetNanos));
+    }
+
+    void reportActualWorkDuration(int64_t actualNanos) override {
+        mReportCount++;
+    }
+
+private:
+    int64_t mReportCount {0};
+};
+
+} // namespace
+
+std::unique_ptr<PerformanceHintSession> PerformanceHintSession::open(const std::vector<int32_t>& threadIds, int64_t targetNanos) {
+    return std::make_unique<LoggingSession>(threadIds, targetNanos);
+}
+
+#endif
+
+PerformanceHintController::PerformanceHintController(SessionFactory factory) : mFactory(std::move(factory)) {}
+
+PerformanceHintController::~PerformanceHintController() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mIsStopping = true;
+    }
+    mCondition.notify_all();
+    if (mControlThread.joinable()) {
+        mControlThread.join();
+    }
+}
+
+void PerformanceHintController::setEnabled(bool isEnabled) {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mIsEnabled = isEnabled;
+        mIsChanged = true;
+        if (isEnabled && !mControlThread.joinable()) {
+            mControlThread = std::thread(&PerformanceHintController::runControl, this);
+        }
+    }
+    mCondition.notify_all();
+}
+
+void PerformanceHintController::reportWorkDuration(int32_t threadId, int64_t actualNanos, int64_t targetNanos) {
+    if (!mIsEnabled) return;
+
+    // The target a session is opened with, published before the thread which opens it
+    mTargetNanos.store(targetNanos);
+    setThreadId(kAudioThread, threadId);
+    if (mIsNotifyPending) {
+        notifyControl();
+    }
+
+    // Announce the session in use and make sure it hasn't been replaced meanwhile, @see publish
+    Session *session = mSession.load();
+    mSessionInUse.store(session);
+    while (session != mSession.load()) {
+        session = mSession.load();
+        mSessionInUse.store(session);
+    }
+
+    if (session) {
+        if (targetNanos != session->targetNanos) {
+            // The buffer size is changed by the latency tuner or the callback size by the stream
+            session->session->updateTargetWorkDuration(targetNanos);
+            session->targetNanos = targetNanos;
+        }
+        session->session->reportActualWorkDuration(actualNanos);
+    }
+    mSessionInUse.store(nullptr);
+}
+
+void PerformanceHintController::setThreadId(ThreadSlot slot, int32_t threadId) {
+    if (mThreadIds[slot].exchange(threadId) != threadId) {
+        mIsChanged = true;
+        notifyControl();
+    }
+}
+
+void PerformanceHintController::notifyControl() {
+    // The real-time threads don't wait for the lock, if it is taken the next report notifies
+    std::unique_lock<std::mutex> lock(mLock, std::try_to_lock);
+    if (lock.owns_lock()) {
+        mIsNotifyPending = false;
+        mCondition.notify_all();
+    } else {
+        mIsNotifyPending = true;
+    }
+}
+
+void PerformanceHintController::runControl() {
+    // Not retried until the threads change, the session won't be created for the same ones either
+    std::vector<int32_t> failedThreadIds;
+
+    std::unique_lock<std::mutex> lock(mLock);
+    while (!mIsStopping) {
+        if (mIsChanged.exchange(false)) {
+            // A thread may come back with the same ID, e.g. a worker restarted with the stream
+            failedThreadIds.clear();
+        }
+
+        std::vector<int32_t> threadIds;
+        if (mIsEnabled) {
+            for (const auto& threadId : mThreadIds) {
+                if (threadId.load() != 0) threadIds.push_back(threadId.load());
+            }
+        }
+
+        Session *session = mSession.load();
+        bool isCurrent = session ? session->threadIds == threadIds
+                                 : threadIds.empty() || threadIds == failedThreadIds;
+        if (!isCurrent) {
+            // The binder calls don't hold up setEnabled
+            lock.unlock();
+            Session *newSession = nullptr;
+            if (!threadIds.empty()) {
+                int64_t targetNanos = mTargetNanos.load();
+                std::unique_ptr<PerformanceHintSession> hintSession = mFactory(threadIds, targetNanos);
+                if (hintSession) {
+                    newSession = new Session {std::move(hintSession), threadIds, targetNanos};
+                } else {
+                    failedThreadIds = threadIds;
+                }
+            }
+            publish(newSession);
+            lock.lock();
+            continue;
+        }
+
+        mCondition.wait(lock, [this] { return mIsStopping || mIsChanged.load(); });
+    }
+    lock.unlock();
+    publish(nullptr);
+}
+
+void PerformanceHintController::publish(Session *session) {
+    Session *previousSession = mSession.exchange(session);
+    while (previousSession && mSessionInUse.load() == previousSession) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    delete previousSession;
+}
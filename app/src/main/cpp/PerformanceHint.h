@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Tells the system how long the work of a thread takes against its target duration, so the CPU
+ * frequency and cores can follow the actual load instead of being guessed by the governor.
+ *
+ * On Android it is an ADPF `APerformanceHint` session, available since API 33 and loaded at run
+ * time. Elsewhere the session only logs what it would report.
+ */
+class PerformanceHintSession {
+public:
+    virtual ~PerformanceHintSession() = default;
+
+    virtual void updateTargetWorkDuration(int64_t targetNanos) = 0;
+    virtual void reportActualWorkDuration(int64_t actualNanos) = 0;
+
+    /**
+     * Open a session for the threads. Creating and closing a session are binder calls, so neither
+     * belongs on a real-time thread.
+     * @return null if performance hints are not supported
+     */
+    static std::unique_ptr<PerformanceHintSession> open(const std::vector<int32_t>& threadIds, int64_t targetNanos);
+};
+
+/**
+ * Keeps a performance hint session for the threads of the audio callback without blocking them.
+ * The real-time threads only publish their IDs and report durations; a control thread opens the
+ * session, reopens it when the threads change, e.g. with a new stream, and closes it.
+ *
+ * The session is published to the reporting thread through an atomic pointer and a hazard slot,
+ * like the graph of `DefaultDataCallback`.
+ */
+class PerformanceHintController {
+public:
+    enum ThreadSlot {
+        kAudioThread,
+        kWorkerThread,
+        kThreadSlotCount
+    };
+
+    using SessionFactory = std::function<std::unique_ptr<PerformanceHintSession>(const std::vector<int32_t>&, int64_t)>;
+
+    explicit PerformanceHintController(SessionFactory factory = PerformanceHintSession::open);
+    ~PerformanceHintController();
+
+    /**
+     * Open the session once the audio thread reports, or close it. Must not be called from the
+     * real-time threads.
+     */
+    void setEnabled(bool isEnabled);
+
+    /**
+     * Real-time threads: include the thread in the session, 0 once it is gone. Doesn't block, when
+     * the control thread can't be woken up at once the next report does it.
+     */
+    void setThreadId(ThreadSlot slot, int32_t threadId);
+
+    /**
+     * Audio thread: report the work duration of a callback and its target. Doesn't block.
+     */
+    void reportWorkDuration(int32_t threadId, int64_t actualNanos, int64_t targetNanos);
+
+    bool hasSession() const { return mSession.load() != nullptr; }
+
+private:
+    struct Session {
+        std::unique_ptr<PerformanceHintSession> session;
+        std::vector<int32_t> threadIds;
+        int64_t targetNanos; // owned by the audio thread once published
+    };
+
+    void notifyControl();
+    void runControl();
+    void publish(Session *session);
+
+    const SessionFactory mFactory;
+
+    std::atomic<Session*> mSession { nullptr };
+    std::atomic<Session*> mSessionInUse { nullptr };
+    std::atomic<int32_t> mThreadIds[kThreadSlotCount] = {};
+    std::atomic<int64_t> mTargetNanos { 0 };
+    std::atomic<bool> mIsEnabled { false };
+    std::atomic<bool> mIsChanged { false }; // the threads or mIsEnabled, for the control thread
+    std::atomic<bool> mIsNotifyPending { false };
+
+    std::mutex mLock;
+    std::condition_variable mCondition;
+    bool mIsStopping = false; // guarded by mLock
+    std::thread mControlThread;
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include "IPlaybackStream.h"
+
+/**
+ * Wait-free single producer single consumer ring of I16 frames, the render-ahead worker renders
+ * into it and the audio callback copies out of it.
+ *
+ * Both indices only grow. The producer owns the write index and the consumer the read one, so each
+ * side needs a single acquire load of the other index and a release store of its own.
+ */
+class RenderAheadBuffer {
+public:
+    /**
+     * @param capacityFrames how far the worker may render ahead of the callbacks
+     * @param chunkFrames how many frames the worker renders at once
+     */
+    RenderAheadBuffer(int32_t sampleRate, int32_t channelCount, int32_t capacityFrames, int32_t chunkFrames)
+            : mSampleRate(sampleRate),
+              mChannelCount(channelCount),
+              mCapacityFrames(capacityFrames),
+              mChunkFrames(std::min(chunkFrames, capacityFrames)),
+              mFrames(std::make_unique<int16_t[]>(static_cast<size_t>(capacityFrames) * channelCount)) {}
+
+    int32_t getSampleRate() const { return mSampleRate; }
+    int32_t getChannelCount() const { return mChannelCount; }
+    int32_t getCapacityFrames() const { return mCapacityFrames; }
+    int32_t getChunkFrames() const { return mChunkFrames; }
+
+    /**
+     * Producer: @return the free space at the write index up to the end of the ring
+     */
+    int16_t *getWriteRegion(int32_t &numFrames) {
+        int64_t writeIndex = mWriteIndex.load(std::memory_order_relaxed);
+        int64_t freeFrames = mCapacityFrames - (writeIndex - mReadIndex.load(std::memory_order_acquire));
+        auto offset = static_cast<int32_t>(writeIndex % mCapacityFrames);
+        numFrames = static_cast<int32_t>(std::min<int64_t>(freeFrames, mCapacityFrames - offset));
+        return mFrames.get() + static_cast<size_t>(offset) * mChannelCount;
+    }
+
+    /**
+     * Producer: publish the frames rendered into the write region.
+     */
+    void commitWrite(int32_t numFrames) {
+        mWriteIndex.store(mWriteIndex.load(std::memory_order_relaxed) + numFrames, std::memory_order_release);
+    }
+
+    /**
+     * Consumer: copy the rendered frames, the ones not rendered in time are filled with silence,
+     * which is counted, @see getSilenceFrames
+     * @return number of rendered frames copied
+     */
+    int32_t read(int16_t *audioData, int32_t numFrames) {
+        int64_t readIndex = mReadIndex.load(std::memory_order_relaxed);
+        int64_t queuedFrames = mWriteIndex.load(std::memory_order_acquire) - readIndex;
+        auto frames = static_cast<int32_t>(std::min<int64_t>(queuedFrames, numFrames));
+        auto offset = static_cast<int32_t>(readIndex % mCapacityFrames);
+        int32_t firstFrames = std::min(frames, mCapacityFrames - offset);
+        size_t frameBytes = mChannelCount * sizeof(int16_t);
+
+        memcpy(audioData, mFrames.get() + static_cast<size_t>(offset) * mChannelCount, firstFrames * frameBytes);
+        memcpy(audioData + firstFrames * mChannelCount, mFrames.get(), (frames - firstFrames) * frameBytes);
+        mReadIndex.store(readIndex + frames, std::memory_order_release);
+
+        if (frames < numFrames) {
+            memset(audioData + frames * mChannelCount, 0, (numFrames - frames) * frameBytes);
+            mSilenceFrames.store(mSilenceFrames.load(std::memory_order_relaxed) + numFrames - frames,
+                                 std::memory_order_release);
+        }
+        return frames;
+    }
+
+    int32_t getFreeFrames() const {
+        return mCapacityFrames - getQueuedFrames();
+    }
+
+    int32_t getQueuedFrames() const {
+        int64_t readIndex = mReadIndex.load(std::memory_order_acquire);
+        return static_cast<int32_t>(mWriteIndex.load(std::memory_order_acquire) - readIndex);
+    }
+
+    /**
+     * @return frames rendered since the buffer was created
+     */
+    int64_t getWrittenFrames() const { return mWriteIndex.load(std::memory_order_acquire); }
+
+    /**
+     * @return frames the consumer had to fill with silence, as the worker was late
+     */
+    int64_t getSilenceFrames() const { return mSilenceFrames.load(std::memory_order_acquire); }
+
+private:
+    const int32_t mSampleRate;
+    const int32_t mChannelCount;
+    const int32_t mCapacityFrames;
+    const int32_t mChunkFrames;
+    const std::unique_ptr<int16_t[]> mFrames;
+
+    std::atomic<int64_t> mWriteIndex {0};
+    std::atomic<int64_t> mReadIndex {0};
+    std::atomic<int64_t> mSilenceFrames {0};
+};
+
+/**
+ * `IPlaybackStream` of a source rendered ahead into a `RenderAheadBuffer`: frames written to it
+ * reach the device stream only after all the frames queued in the buffer.
+ */
+class RenderAheadStream : public IPlaybackStream {
+public:
+    RenderAheadStream(std::shared_ptr<IPlaybackStream> deviceStream, std::shared_ptr<RenderAheadBuffer> buffer)
+            : mDeviceStream(std::move(deviceStream)), mBuffer(std::move(buffer)) {}
+
+    int32_t getSampleRate() const override { return mDeviceStream->getSampleRate(); }
+    int32_t getChannelCount() const override { return mDeviceStream->getChannelCount(); }
+    int64_t getFramesWritten() override { return mBuffer->getWrittenFrames(); }
+
+    bool calculateLatencyMillis(double &latencyMills) override {
+        return mDeviceStream->calculateLatencyMillis(latencyMills);
+    }
+
+    /**
+     * Every frame the device stream has been given is either rendered or silence inserted on
+     * underrun, so the rest of the rendered frames is still queued. The device stream counts its
+     * frames first, so a callback copying meanwhile is counted as queued rather than lost.
+     */
+    int64_t getPipelineFrames() override {
+        int64_t deviceFramesWritten = mDeviceStream->getFramesWritten();
+        return mBuffer->getWrittenFrames() + mBuffer->getSilenceFrames() - deviceFramesWritten;
+    }
+
+    double nowMills() override { return mDeviceStream->nowMills(); }
+
+private:
+    const std::shared_ptr<IPlaybackStream> mDeviceStream;
+    const std::shared_ptr<RenderAheadBuffer> mBuffer;
+};
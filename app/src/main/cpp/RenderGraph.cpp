@@ -0,0 +1,155 @@
+#include "RenderGraph.h"
+#include "logging_macros.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+static constexpr float kSampleScale = 32768.0f;
+
+namespace {
+
+class SourceNode : public RenderNode {
+public:
+    SourceNode(std::shared_ptr<IRenderableAudio> renderable, std::string name)
+            : RenderNode(std::move(name)), mRenderable(std::move(renderable)) {}
+
+    void allocate(int32_t channelCount, int32_t maxFrames) override {
+        mBuffer.resize(static_cast<size_t>(channelCount) * maxFrames);
+    }
+
+    void process(const std::vector<const float*>& inputs, float *output, int32_t numFrames, int32_t channelCount) override {
+        mRenderable->renderAudio(mBuffer.data(), numFrames);
+        for (int32_t i = 0; i < numFrames * channelCount; ++i) {
+            output[i] = mBuffer[i] / kSampleScale;
+        }
+    }
+
+    IRenderableAudio *getRenderable() { return mRenderable.get(); }
+
+private:
+    const std::shared_ptr<IRenderableAudio> mRenderable;
+    std::vector<int16_t> mBuffer;
+};
+
+} // namespace
+
+RenderGraph::RenderGraph(int32_t channelCount, int32_t maxFrames)
+        : mChannelCount(channelCount), mMaxFrames(maxFrames) {}
+
+int RenderGraph::addSource(std::shared_ptr<IRenderableAudio> renderable, std::string name) {
+    return addNode(std::make_unique<SourceNode>(std::move(renderable), std::move(name)), {});
+}
+
+int RenderGraph::addNode(std::unique_ptr<RenderNode> node, std::vector<int> inputs) {
+    node->mInputs = std::move(inputs);
+    mNodes.push_back(std::move(node));
+    return static_cast<int>(mNodes.size()) - 1;
+}
+
+bool RenderGraph::compile() {
+    int nodeCount = static_cast<int>(mNodes.size());
+    if (mOutput < 0 || mOutput >= nodeCount) {
+        LOGE("RenderGraph: output is not set");
+        return false;
+    }
+
+    // Walk back from the output, inputs always precede their consumer
+    std::vector<int> consumers(nodeCount, 0);
+    std::vector<bool> isReachable(nodeCount, false);
+    isReachable[mOutput] = true;
+
+    for (int node = nodeCount - 1; node >= 0; --node) {
+        if (!isReachable[node]) continue;
+        for (int input : mNodes[node]->mInputs) {
+            if (input < 0 || input >= node || ++consumers[input] > 1) {
+                LOGE("RenderGraph: bad input %d of node %d", input, node);
+                return false;
+            }
+            isReachable[input] = true;
+        }
+    }
+
+    // Every node has a single consumer, so each one knows its own frame count bound
+    std::vector<int32_t> maxFrames(nodeCount, 0);
+    maxFrames[mOutput] = mMaxFrames;
+    for (int node = nodeCount - 1; node >= 0; --node) {
+        if (!isReachable[node]) continue;
+        for (int input : mNodes[node]->mInputs) {
+            maxFrames[input] = mNodes[node]->getMaxInputFrames(maxFrames[node]);
+        }
+    }
+
+    mSchedule.clear();
+    for (int node = 0; node < nodeCount; ++node) {
+        if (!isReachable[node]) continue;
+
+        RenderNode *renderNode = mNodes[node].get();
+        renderNode->allocate(mChannelCount, maxFrames[node]);
+        renderNode->mOutputBuffer.assign(static_cast<size_t>(mChannelCount) * maxFrames[node], 0.0f);
+        renderNode->mInputBuffers.clear();
+        for (int input : renderNode->mInputs) {
+            renderNode->mInputBuffers.push_back(mNodes[input]->mOutputBuffer.data());
+        }
+        mSchedule.push_back(renderNode);
+    }
+
+    auto source = dynamic_cast<SourceNode*>(mSchedule.front());
+    mDirectSource = mSchedule.size() == 1 && source ? source->getRenderable() : nullptr;
+    return true;
+}
+
+void RenderGraph::render(int16_t *audioData, int32_t numFrames) {
+    if (mDirectSource) {
+        auto start = std::chrono::steady_clock::now();
+        mDirectSource->renderAudio(audioData, numFrames);
+
+        RenderNode *node = mSchedule.front();
+        node->mProcessNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        node->mCallCount++;
+        return;
+    }
+
+    while (numFrames > 0) {
+        int32_t chunkFrames = std::min(numFrames, mMaxFrames);
+        renderChunk(audioData, chunkFrames);
+        audioData += chunkFrames * mChannelCount;
+        numFrames -= chunkFrames;
+    }
+}
+
+void RenderGraph::renderChunk(int16_t *audioData, int32_t numFrames) {
+    // Frame counts are propagated from the output back to the sources first
+    mSchedule.back()->mFrames = numFrames;
+    for (auto it = mSchedule.rbegin(); it != mSchedule.rend(); ++it) {
+        for (int input : (*it)->mInputs) {
+            mNodes[input]->mFrames = (*it)->getInputFrames((*it)->mFrames);
+        }
+    }
+
+    for (RenderNode *node : mSchedule) {
+        auto start = std::chrono::steady_clock::now();
+        node->process(node->mInputBuffers, node->mOutputBuffer.data(), node->mFrames, mChannelCount);
+        node->mProcessNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        node->mCallCount++;
+    }
+
+    const float *output = mSchedule.back()->mOutputBuffer.data();
+    for (int32_t i = 0; i < numFrames * mChannelCount; ++i) {
+        float sample = std::round(output[i] * kSampleScale);
+        audioData[i] = static_cast<int16_t>(std::min(32767.0f, std::max(-32768.0f, sample)));
+    }
+}
+
+std::string RenderGraph::getCostReport() const {
+    std::string report;
+    char line[128];
+    for (const RenderNode *node : mSchedule) {
+        int64_t callCount = node->mCallCount;
+        double micros = callCount > 0 ? node->mProcessNanos / 1000.0 / callCount : 0;
+        snprintf(line, sizeof(line), "%s%s: %.1f us", report.empty() ? "" : "; ", node->getName().c_str(), micros);
+        report += line;
+    }
+    return report;
+}
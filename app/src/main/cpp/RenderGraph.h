@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include "IRenderableAudio.h"
+
+/**
+ * A processing stage of `RenderGraph`. Nodes work on interleaved float frames and must not
+ * allocate or block in `process`, it is called from the audio thread.
+ */
+class RenderNode {
+public:
+    explicit RenderNode(std::string name) : mName(std::move(name)) {}
+    virtual ~RenderNode() = default;
+
+    /**
+     * @return number of frames required from each input to produce numFrames
+     */
+    virtual int32_t getInputFrames(int32_t numFrames) { return numFrames; }
+
+    /**
+     * @return upper bound of `getInputFrames` for any numFrames up to maxFrames
+     */
+    virtual int32_t getMaxInputFrames(int32_t maxFrames) { return maxFrames; }
+
+    /**
+     * Preallocate the node state, called once when the graph is compiled.
+     */
+    virtual void allocate(int32_t channelCount, int32_t maxFrames) {}
+
+    virtual void process(const std::vector<const float*>& inputs,
+                         float *output,
+                         int32_t numFrames,
+                         int32_t channelCount) = 0;
+
+    const std::string& getName() const { return mName; }
+
+private:
+    friend class RenderGraph;
+
+    const std::string mName;
+    std::vector<int> mInputs;
+    std::vector<const float*> mInputBuffers;
+    std::vector<float> mOutputBuffer;
+    int32_t mFrames = 0;
+    std::atomic<int64_t> mCallCount {0};
+    std::atomic<int64_t> mProcessNanos {0};
+};
+
+/**
+ * A small graph of processing stages rendering into the stream buffer.
+ *
+ * Nodes are added in the order they are executed, so every node can only take the nodes added before
+ * as its inputs, and each node feeds at most one consumer. `compile` flattens the nodes reachable from
+ * the output into an execution schedule and preallocates all the buffers, after which the graph can be
+ * rendered from the audio thread. The graph is not modified once compiled, a new one is built instead.
+ */
+class RenderGraph {
+public:
+    RenderGraph(int32_t channelCount, int32_t maxFrames);
+
+    int addSource(std::shared_ptr<IRenderableAudio> renderable, std::string name = "source");
+
+    void setOutput(int node) { mOutput = node; }
+
+    /**
+     * @return false if the graph is malformed
+     */
+    bool compile();
+
+    void render(int16_t *audioData, int32_t numFrames);
+
+    /**
+     * @return average processing time of every scheduled node, can be called from any thread
+     */
+    std::string getCostReport() const;
+
+private:
+    int addNode(std::unique_ptr<RenderNode> node, std::vector<int> inputs);
+    void renderChunk(int16_t *audioData, int32_t numFrames);
+
+    const int32_t mChannelCount;
+    const int32_t mMaxFrames;
+    std::vector<std::unique_ptr<RenderNode>> mNodes;
+    std::vector<RenderNode*> mSchedule;
+    int mOutput = -1;
+
+    // A graph made of a single source renders straight into the stream buffer
+    IRenderableAudio *mDirectSource = nullptr;
+};
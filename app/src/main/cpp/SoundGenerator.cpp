@@ -16,82 +16,134 @@
 
 #include "SoundGenerator.h"
 #include "logging_macros.h"
+#include "Trace.h"
 #include "utils.h"
 
-static constexpr int64_t kHardSyncThresholdMills = 200;
-static constexpr int64_t kSoftSyncThresholdMills = 2;
-static constexpr int64_t kSoftSyncIntervalFrames = 50;
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
-SoundGenerator::SoundGenerator(std::shared_ptr<oboe::AudioStream> oboeStream)
-        : mStream(std::move(oboeStream)) {}
+SoundGenerator::SoundGenerator(std::shared_ptr<IPlaybackStream> stream)
+        : mStream(std::move(stream)) {}
 
 void SoundGenerator::renderAudio(int16_t *audioData, int32_t numFrames) {
+    TRACE_SCOPE("SoundGenerator::renderAudio");
+
+    double latencyMills;
+    if (mStream->calculateLatencyMillis(latencyMills)) {
+        learnLatency(latencyMills);
+    } else {
+        latencyMills = mDefaultLatencyMills;
+    }
+
     if (!mIsPlaying) {
         memset(audioData, 0, numFrames * mStream->getBytesPerFrame());
         mEmptyFramesWritten += numFrames;
         return;
     }
 
-    int64_t millsSinceStart = millsNow() - mStartTimestamp;
-    int64_t estimatedOffsetMills = (mStartOffsetMills + millsSinceStart + mPlaybackShiftMills) % mSizeMills;
-
-    int64_t synchronizationOffsetMillsForward = (estimatedOffsetMills - getCurrentPositionMills()) % mSizeMills;
-    int64_t synchronizationOffsetMillsBackward = (synchronizationOffsetMillsForward + mSizeMills) % mSizeMills;
-
-    // (estimatedOffsetMills - getCurrentPositionMills()) could be big negative as almost -mSizeMills when passing zero position.
-    // So we add extra mSizeMills here to avoid unnecessary hard synchronizations.
-    int64_t synchronizationOffsetMills = abs(synchronizationOffsetMillsForward) < abs(synchronizationOffsetMillsBackward)
-            ? synchronizationOffsetMillsForward
-            : synchronizationOffsetMillsBackward;
-
-    int64_t synchronizationPatchSamples = 0;
-
-//    static int k = 0;
-//    if (k++ % 100 == 0) {
-//        LOGD("synchronizationOffsetMills: %ld", synchronizationOffsetMills);
-//    }
-
     bool isJustStarted = mIsJustStarted.exchange(false);
     if (isJustStarted) {
-        mSizeSamples = millsToSamples(mSizeMills, mStream);
-        mPositionSamples = millsToSamples(mStartOffsetMills, mStream);
+        mSizeFrames = millsToFrames(mSizeMills, mStream);
+        mPositionFrames = millsToFrames(mStartOffsetMills, mStream);
+        mSyncController.reset();
+        mPatchRemainder = 0;
     }
 
-    if (isJustStarted || abs(synchronizationOffsetMills) > kHardSyncThresholdMills) {
-        LOGD("synchronization: hard shift: %ld", synchronizationOffsetMills);
-        int64_t patchSamples = millsToSamples(synchronizationOffsetMills, mStream);
-        updatePosition(mPositionSamples + patchSamples);
-        mTotalPatchSamples += patchSamples;
-    } else if (abs(synchronizationOffsetMills) > kSoftSyncThresholdMills) {
-        // soft adjust
-        synchronizationPatchSamples = synchronizationOffsetMills > 0 ? 1 : -1;
+    double errorMills = getSyncErrorMills(latencyMills);
+    TRACE_COUNTER("syncErrorMicros", llround(errorMills * 1000));
+
+    double presentationMills = mStream->nowMills() + latencyMills + framesToMills(mStream->getPipelineFrames(), mStream);
+    bool isRecorded = mIsMetricsEnabled && isAudible(presentationMills);
+    if (isJustStarted) {
+        mSyncMetrics.recordFirstSample(presentationMills);
+    } else if (isRecorded) {
+        mSyncMetrics.recordError(errorMills, presentationMills, numFrames, mStream->getSampleRate());
     }
 
-    auto source = reinterpret_cast<int16_t*>(mBuffer.get());
+    int64_t patchFrames = 0;
+    if (isJustStarted || mSyncController.isHardSyncNeeded(errorMills)) {
+        LOGD("synchronization: hard shift: %.1f", errorMills);
+        TRACE_COUNTER("hardSyncMills", llround(errorMills));
+        if (!isJustStarted) {
+            if (isRecorded) mSyncMetrics.countHardCorrection();
+            mSyncController.onHardSync();
+        }
+        // Positioning the start on this stream isn't a correction of the playback
+        int64_t jumpFrames = millsToFrames(errorMills, mStream);
+        updatePosition(mPositionFrames + jumpFrames);
+        if (isJustStarted) {
+            mPositioningFrames += jumpFrames;
+        } else {
+            mTotalPatchFrames += jumpFrames;
+        }
+    } else {
+        // The fraction of a frame left is carried over to the next callbacks
+        double rate = mSyncController.update(errorMills, numFrames, mStream->getSampleRate());
+        TRACE_COUNTER("syncCorrectionPpm", llround(rate * 1000000));
+        mPatchRemainder += rate * numFrames;
+        patchFrames = static_cast<int64_t>(mPatchRemainder);
+        mPatchRemainder -= patchFrames;
+    }
 
-    int channelCount = mStream->getChannelCount();
+    int32_t channelCount = mStream->getChannelCount();
+    int64_t patchCount = std::min<int64_t>(std::abs(patchFrames), numFrames);
+    int64_t patchDirection = patchFrames > 0 ? 1 : -1;
+    int64_t patchesDone = 0;
 
-    for (int j = 0; j < numFrames; ++j) {
-        for (int i = 0; i < channelCount; ++i) {
-            audioData[(j * channelCount) + i] = source[mPositionSamples];
-            updatePosition(mPositionSamples + 1);
+    // Render contiguous chunks, which end at the loop end, at the timeline entry boundaries and at
+    // the patch points, which skip or repeat a frame each and are spread evenly over the callback
+    for (int32_t j = 0; j < numFrames;) {
+        int64_t chunkFrames = numFrames - j;
+        if (patchesDone < patchCount) {
+            if (j == patchesDone * numFrames / patchCount) {
+                updatePosition(mPositionFrames + patchDirection);
+                mTotalPatchFrames += patchDirection;
+                if (isRecorded) mSyncMetrics.countSoftCorrection();
+                patchesDone++;
+            }
+            if (patchesDone < patchCount) {
+                chunkFrames = patchesDone * numFrames / patchCount - j;
+            }
         }
+        chunkFrames = std::min<int64_t>(chunkFrames, mSizeFrames - mPositionFrames);
 
-        if (synchronizationPatchSamples != 0 && j % kSoftSyncIntervalFrames == 0) {
-            updatePosition(mPositionSamples + synchronizationPatchSamples);
-            mTotalPatchSamples += synchronizationPatchSamples;
-        }
+        Timeline::Location location = mTimeline->locate(mPositionFrames);
+        chunkFrames = std::min(chunkFrames, location.framesToBoundary);
+        renderTrack(location, audioData + j * channelCount, static_cast<int32_t>(chunkFrames));
+        updatePosition(mPositionFrames + chunkFrames);
+        j += chunkFrames;
     }
+    mTimeline->setPlayhead(mPositionFrames);
+
+    applyFade(audioData, numFrames, latencyMills);
 }
 
 int64_t SoundGenerator::getCurrentPositionMills() {
-    auto latencyResult = mStream->calculateLatencyMillis();
-    double latencyMills = latencyResult ? latencyResult.value() : kDefaultLatency;
-    int64_t latencyFrames = millsToFrames(latencyMills, mStream);
+    double latencyMills;
+    if (!mStream->calculateLatencyMillis(latencyMills)) {
+        latencyMills = mDefaultLatencyMills;
+    }
+    return getPositionMills(latencyMills);
+}
+
+double SoundGenerator::getLatencyMills() {
+    double latencyMills;
+    if (!mStream->calculateLatencyMillis(latencyMills)) {
+        latencyMills = mDefaultLatencyMills;
+    }
+    return latencyMills + framesToMills(mStream->getPipelineFrames(), mStream);
+}
+
+int64_t SoundGenerator::getPositionMills(double latencyMills) {
+    // The pipeline is counted in frames, so it doesn't lose a frame to rounding
+    int64_t latencyFrames = millsToFrames(latencyMills, mStream) + mStream->getPipelineFrames();
 
     int64_t audioFramesWritten = mStream->getFramesWritten() - mEmptyFramesWritten - latencyFrames;
     int64_t writtenMills = audioFramesWritten * 1000 / mStream->getSampleRate();
-    int64_t patchMills = samplesToMills(mTotalPatchSamples, mStream);
+    int64_t patchMills = framesToMills(mTotalPatchFrames + mPositioningFrames, mStream);
     int64_t playedMills = mStartOffsetMills + writtenMills + patchMills;
     int64_t currentPositionMills = (mSizeMills > 0) ? playedMills % mSizeMills : playedMills;
 
@@ -102,25 +154,64 @@ int64_t SoundGenerator::getCurrentPositionMills() {
     return currentPositionMills;
 }
 
-void SoundGenerator::prepare(const std::string& filePath) {
-    FILE *fp = fopen(filePath.c_str(), "r");
+double SoundGenerator::getSyncErrorMills(double latencyMills) {
+    // The start offset is part of both positions, so only the time since the start is compared
+    double latencyFrames = latencyMills * mStream->getSampleRate() / 1000 + mStream->getPipelineFrames();
+    double playedFrames = mStream->getFramesWritten() - mEmptyFramesWritten - latencyFrames
+            + mTotalPatchFrames + mPositioningFrames;
+    double targetMills = mStream->nowMills() - mStartTimestamp + mPlaybackShiftMills + mPeerShiftMills;
+    double errorMills = std::fmod(targetMills - playedFrames * 1000 / mStream->getSampleRate(), mSizeMills);
+
+    // A hard synchronization may have jumped across the loop end, which moves by whole loops
+    if (errorMills > mSizeMills / 2.0) return errorMills - mSizeMills;
+    if (errorMills < -mSizeMills / 2.0) return errorMills + mSizeMills;
+    return errorMills;
+}
+
+void SoundGenerator::renderTrack(const Timeline::Location& location, int16_t *audioData, int32_t numFrames) {
+    const int16_t *samples = location.trackIndex != Timeline::kGap ? mTimeline->acquireTrack(location.trackIndex) : nullptr;
+    if (!samples) {
+        if (location.trackIndex != Timeline::kGap) mTimeline->addMissedFrames(numFrames);
+        memset(audioData, 0, numFrames * mStream->getBytesPerFrame());
+        return;
+    }
+
+    const ChannelMapper& mapper = mChannelMappers[location.trackIndex];
+    mapper.map(samples + location.trackFrame * mapper.getInputChannelCount(), audioData, numFrames);
+    mTimeline->releaseTrack(location.trackIndex);
+}
+
+void SoundGenerator::prepare(std::shared_ptr<Timeline> timeline) {
+    // The mappers are only rebuilt for another timeline, so a stream which already renders keeps using them
+    if (timeline == mTimeline) return;
 
-    fseek(fp, 0L, SEEK_END);
-    long size = ftell(fp);
+    std::vector<ChannelMapper> mappers;
+    for (int32_t i = 0; i < timeline->getTrackCount(); i++) {
+        LOGD("channel mapping of track %d: %d -> %d", i, timeline->getTrackChannelCount(i), mStream->getChannelCount());
+        mappers.emplace_back(timeline->getTrackChannelCount(i), mStream->getChannelCount());
+    }
+    mChannelMappers = std::move(mappers);
+    mTimeline = std::move(timeline);
+    mSizeMills = mTimeline->getPeriodMills();
+}
 
-    auto buf = std::make_unique<char[]>(size);
-    mBuffer.swap(buf);
+void SoundGenerator::continueFrom(const SoundGenerator& other) {
+    if (other.mTimeline) prepare(other.mTimeline);
 
-    fseek(fp, 0L, SEEK_SET);
-    fread(mBuffer.get(), 1, size, fp);
+    mStartTimestamp = other.mStartTimestamp.load();
+    mStartOffsetMills = other.mStartOffsetMills.load();
+    mPlaybackShiftMills = other.mPlaybackShiftMills.load();
+    mPeerShiftMills = other.mPeerShiftMills.load();
+    mSyncController.setConfig(other.mSyncController.getConfig());
 
-    fclose(fp);
+    mIsJustStarted = other.mIsPlaying.load();
+    mIsPlaying = other.mIsPlaying.load();
 }
 
-void SoundGenerator::play(int64_t offsetMills, int64_t sizeMills) {
-    mStartTimestamp = millsNow();
+void SoundGenerator::play(int64_t offsetMills, double requestMills) {
+    mStartTimestamp = mStream->nowMills();
     mStartOffsetMills = offsetMills;
-    mSizeMills = sizeMills;
+    mSyncMetrics.setPlayRequestMills(requestMills);
 
     mIsJustStarted = true;
     mIsPlaying = true;
@@ -132,12 +223,88 @@ void SoundGenerator::setPlaybackShift(int64_t playbackShiftMills) {
 }
 
 int64_t SoundGenerator::getTotalPatchMills() {
-    return samplesToMills(mTotalPatchSamples, mStream);
+    return framesToMills(mTotalPatchFrames, mStream);
 }
 
-void SoundGenerator::updatePosition(int64_t positionSamples) {
-    mPositionSamples = positionSamples % mSizeSamples;
-    if (mPositionSamples < 0) {
-        mPositionSamples += mSizeSamples;
+int64_t SoundGenerator::getTargetPositionMills() {
+    if (!mIsPlaying) return -1;
+
+    int64_t millsSinceStart = mStream->nowMills() - mStartTimestamp;
+    return (mStartOffsetMills + millsSinceStart + mPlaybackShiftMills) % mSizeMills;
+}
+
+void SoundGenerator::setPeerShift(int64_t peerShiftMills) {
+    LOGD("setPeerShift: %ld; old: %ld", peerShiftMills, mPeerShiftMills.load());
+    mPeerShiftMills = peerShiftMills;
+}
+
+void SoundGenerator::setSyncConfig(const SyncController::Config& config) {
+    mSyncController.setConfig(config);
+}
+
+void SoundGenerator::setFadeIn(double presentationMills) {
+    mFadeInMills = presentationMills;
+}
+
+void SoundGenerator::setFadeOut(double presentationMills) {
+    mFadeOutMills = presentationMills;
+}
+
+void SoundGenerator::setMetricsEnabled(bool isEnabled) {
+    mIsMetricsEnabled = isEnabled;
+}
+
+bool SoundGenerator::isAudible(double presentationMills) {
+    // From the start of the fade-in to the start of the fade-out, so during a handover the output
+    // is accounted to one source at a time
+    double fadeOutMills = mFadeOutMills;
+    return presentationMills >= mFadeInMills && (fadeOutMills == 0 || presentationMills < fadeOutMills);
+}
+
+void SoundGenerator::setDefaultLatencyMills(double latencyMills) {
+    LOGD("setDefaultLatencyMills: %.1f", latencyMills);
+    mDefaultLatencyMills = latencyMills;
+}
+
+double SoundGenerator::getLearnedLatencyMills() {
+    return mLatencyMeasurements > 0 ? mLearnedLatencyMills.load() : mDefaultLatencyMills.load();
+}
+
+void SoundGenerator::learnLatency(double latencyMills) {
+    // Running mean over the session, it is only updated from the audio thread
+    int64_t measurements = mLatencyMeasurements + 1;
+    mLearnedLatencyMills = mLearnedLatencyMills + (latencyMills - mLearnedLatencyMills) / measurements;
+    mLatencyMeasurements = measurements;
+}
+
+void SoundGenerator::updatePosition(int64_t positionFrames) {
+    mPositionFrames = positionFrames % mSizeFrames;
+    if (mPositionFrames < 0) {
+        mPositionFrames += mSizeFrames;
+    }
+}
+
+void SoundGenerator::applyFade(int16_t *audioData, int32_t numFrames, double latencyMills) {
+    double fadeInMills = mFadeInMills;
+    double fadeOutMills = mFadeOutMills;
+    if (fadeInMills == 0 && fadeOutMills == 0) return;
+
+    int channelCount = mStream->getChannelCount();
+    double frameMills = 1000.0 / mStream->getSampleRate();
+    double presentationMills = mStream->nowMills() + latencyMills + framesToMills(mStream->getPipelineFrames(), mStream);
+
+    for (int j = 0; j < numFrames; ++j, presentationMills += frameMills) {
+        double gain = 1;
+        if (fadeInMills != 0) {
+            gain *= std::min(1.0, std::max(0.0, (presentationMills - fadeInMills) / kHandoverFadeMills));
+        }
+        if (fadeOutMills != 0) {
+            gain *= std::min(1.0, std::max(0.0, 1 - (presentationMills - fadeOutMills) / kHandoverFadeMills));
+        }
+
+        for (int i = 0; i < channelCount; ++i) {
+            int16_t &sample = audioData[(j * channelCount) + i];
+            sample = static_cast<int16_t>(sample * gain);
+        }
     }
 }
@@ -18,39 +18,163 @@
 #define SAMPLES_SOUNDGENERATOR_H
 
 
-#include <oboe/AudioStream.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include "ChannelMapper.h"
+#include "IPlaybackStream.h"
 #include "IRenderableAudio.h"
+#include "SyncController.h"
+#include "SyncMetrics.h"
+#include "Timeline.h"
+#include "utils.h"
+
+constexpr double kHandoverFadeMills = 5;
 
 class SoundGenerator : public IRenderableAudio {
 public:
-    SoundGenerator(std::shared_ptr<oboe::AudioStream> oboeStream);
+    SoundGenerator(std::shared_ptr<IPlaybackStream> stream);
+
+    /**
+     * Play the compiled timeline, which may be shared with other generators. Its tracks may have
+     * other channel counts than the stream.
+     */
+    void prepare(std::shared_ptr<Timeline> timeline);
+
+    /**
+     * Take over the prepared timeline and the playback state of another generator, which is used
+     * when the playback is handed over to another stream. The first callback of this generator will
+     * hard synchronize using the latency of its own stream, which isn't counted as a patch, and the
+     * patches of the other generator stay with it.
+     */
+    void continueFrom(const SoundGenerator& other);
 
-    void prepare(const std::string& filePath);
-    void play(int64_t offsetMills, int64_t sizeMills);
+    /**
+     * Start playing the timeline at the position, in milliseconds of its schedule.
+     * @param requestMills when the playback was asked for, in `IPlaybackStream::nowMills` time base,
+     * the time to the first sample and to the lock are measured from it, @see SyncMetrics
+     */
+    void play(int64_t offsetMills, double requestMills);
     void setPlaybackShift(int64_t playbackShiftMills);
 
+    /**
+     * Set the extra shift estimated against the nearby devices, @see PeerSync
+     */
+    void setPeerShift(int64_t peerShiftMills);
+
+    /**
+     * Set the gains and the limits of the synchronization, @see SyncController. Must be called
+     * before the stream starts.
+     */
+    void setSyncConfig(const SyncController::Config& config);
+
+    /**
+     * Make the output audible only from the given presentation time, in `IPlaybackStream::nowMills` time base.
+     * Output presented before is silent and the volume ramps up during `kHandoverFadeMills`.
+     * 0 disables fading in.
+     */
+    void setFadeIn(double presentationMills);
+
+    /**
+     * Make the output silent from the given presentation time, ramping the volume down during
+     * `kHandoverFadeMills`. 0 disables fading out.
+     */
+    void setFadeOut(double presentationMills);
+
+    /**
+     * Record the sync metrics of the output heard, i.e. between the fades. Enabled by default, a
+     * source prepared for a handover doesn't record until it is switched to.
+     */
+    void setMetricsEnabled(bool isEnabled);
+
     void renderAudio(int16_t *audioData, int32_t numFrames) override;
 
+    /**
+     * @return frames skipped minus frames repeated to correct the playback, not including the jump
+     * to the start position
+     */
     int64_t getTotalPatchMills();
     int64_t getCurrentPositionMills();
 
+    /**
+     * @return latency of the frames written now: the one calculated by the stream, or the default
+     * one, and the frames still queued in front of the stream, @see IPlaybackStream::getPipelineFrames
+     */
+    double getLatencyMills();
+    int64_t getSizeMills() { return mSizeMills; }
+    bool isPlaying() { return mIsPlaying; }
+
+    /**
+     * @return the position which should be played now according to the server time, not including
+     * the peer shift, or -1 if playback is not started yet
+     */
+    int64_t getTargetPositionMills();
+
+    /**
+     * Set the latency used while the stream is not able to calculate its own one yet.
+     * Normally it is the value learned for the same route in the previous sessions.
+     */
+    void setDefaultLatencyMills(double latencyMills);
+    double getDefaultLatencyMills() { return mDefaultLatencyMills; }
+
+    /**
+     * @return mean of the latencies successfully calculated by the stream during this session
+     */
+    double getLearnedLatencyMills();
+    int64_t getLatencyMeasurements() { return mLatencyMeasurements; }
+
+    /**
+     * @return synchronization errors and corrections of the callbacks since the playback started
+     */
+    const SyncMetrics& getSyncMetrics() const { return mSyncMetrics; }
+
 private:
-    void updatePosition(int64_t positionSamples);
+    int64_t getPositionMills(double latencyMills);
+
+    /**
+     * @return target position minus the position presented at the frame written now, unlike the
+     * synchronization offset not rounded to milliseconds
+     */
+    double getSyncErrorMills(double latencyMills);
+    void learnLatency(double latencyMills);
+    void renderTrack(const Timeline::Location& location, int16_t *audioData, int32_t numFrames);
+    void updatePosition(int64_t positionFrames);
+    void applyFade(int16_t *audioData, int32_t numFrames, double latencyMills);
+    bool isAudible(double presentationMills);
 
 private:
-    const std::shared_ptr<oboe::AudioStream> mStream;
-    std::unique_ptr<char[]> mBuffer;
+    const std::shared_ptr<IPlaybackStream> mStream;
+    std::shared_ptr<Timeline> mTimeline;
+    std::vector<ChannelMapper> mChannelMappers; // indexed by the timeline track
 
-    int64_t mSizeSamples {0};
-    int64_t mPositionSamples {0};
+    // In frames of the timeline schedule, which are the same as the stream frames
+    int64_t mSizeFrames {0};
+    int64_t mPositionFrames {0};
+
+    // Owned by the audio thread
+    SyncController mSyncController;
+    double mPatchRemainder {0}; // fraction of a frame the controller asked for and not patched yet
 
     std::atomic<double> mStartTimestamp {0};
     std::atomic_int64_t mStartOffsetMills {0};
     std::atomic_int64_t mSizeMills {0};
 
     std::atomic_int64_t mEmptyFramesWritten {0};
-    std::atomic_int64_t mTotalPatchSamples {0};
+    std::atomic_int64_t mTotalPatchFrames {0};
+    std::atomic_int64_t mPositioningFrames {0}; // jumped by the first callback of a playback
     std::atomic_int64_t mPlaybackShiftMills {0};
+    std::atomic_int64_t mPeerShiftMills {0};
+
+    std::atomic<double> mDefaultLatencyMills {kDefaultLatency};
+    std::atomic<double> mLearnedLatencyMills {0};
+    std::atomic_int64_t mLatencyMeasurements {0};
+
+    std::atomic<double> mFadeInMills {0};
+    std::atomic<double> mFadeOutMills {0};
+
+    SyncMetrics mSyncMetrics;
+    std::atomic_bool mIsMetricsEnabled {true};
 
     std::atomic_bool mIsJustStarted {false};
     std::atomic_bool mIsPlaying {false};
@@ -0,0 +1,39 @@
+#include "SyncController.h"
+
+#include <algorithm>
+#include <cmath>
+
+bool SyncController::isHardSyncNeeded(double errorMills) const {
+    return std::abs(errorMills) > mConfig.hardSyncThresholdMills;
+}
+
+double SyncController::update(double errorMills, int32_t numFrames, int32_t sampleRate) {
+    double errorSeconds = errorMills / 1000;
+    double elapsedSeconds = static_cast<double>(numFrames) / sampleRate;
+    bool isAcquiring = std::abs(errorMills) > mConfig.acquisitionThresholdMills;
+    double maxRate = isAcquiring ? std::max(mConfig.maxCorrectionRate, mConfig.maxAcquisitionRate)
+                                 : mConfig.maxCorrectionRate;
+
+    // Conditional integration: not while the output is saturated in the direction of the error, nor
+    // while acquiring, as the integral only learns the drift and would overshoot a caught up step
+    double integral = mErrorIntegral + errorSeconds * elapsedSeconds;
+    double output = mConfig.proportionalGain * errorSeconds + mConfig.integralGain * integral;
+    bool isSaturated = std::abs(output) > maxRate && (output > 0) == (errorSeconds > 0);
+    if (!isSaturated && !isAcquiring && mConfig.integralGain > 0) {
+        // The integral term alone never asks for more than the tracking range
+        double maxIntegral = mConfig.maxCorrectionRate / mConfig.integralGain;
+        mErrorIntegral = std::min(maxIntegral, std::max(-maxIntegral, integral));
+    }
+
+    double targetRate = mConfig.proportionalGain * errorSeconds + mConfig.integralGain * mErrorIntegral;
+    targetRate = std::min(maxRate, std::max(-maxRate, targetRate));
+
+    double maxStep = mConfig.maxSlewRate * elapsedSeconds;
+    mRate += std::min(maxStep, std::max(-maxStep, targetRate - mRate));
+    return mRate;
+}
+
+void SyncController::reset() {
+    mErrorIntegral = 0;
+    mRate = 0;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * PI controller of the synchronization: turns the error measured at every callback into the rate
+ * frames are skipped at, or repeated at while it is negative, so the correction is proportional to
+ * the error instead of a fixed step beyond a threshold.
+ *
+ * The playback position integrates the rate, so the proportional term alone closes the loop and the
+ * integral one learns the constant rate which compensates the drift of the device clock against the
+ * server time. The integral stops growing while the rate is saturated towards the error, so it
+ * doesn't overshoot once the error is caught up, and the rate changes at most by `maxSlewRate`.
+ * Large errors are acquired at a higher rate limit, small ones are tracked at the low one, which keeps
+ * the steady corrections sparse. An update takes constant time.
+ *
+ * Errors beyond `hardSyncThresholdMills` would take too long to catch up, so the position jumps.
+ */
+class SyncController {
+public:
+    /**
+     * The defaults are tuned with the offline renderer scenarios: higher gains catch latency steps
+     * up a bit sooner but chase the noise of the timestamps, skipping several times more frames.
+     */
+    struct Config {
+        // Correction rate per second of error, the inverse of the loop time constant
+        double proportionalGain = 2;
+        // Correction rate per second of error per second, critically damped at proportionalGain^2 / 4
+        double integralGain = 1;
+        // Frames skipped or repeated per frame played
+        double maxCorrectionRate = 0.02;
+        // Change of the correction rate per second
+        double maxSlewRate = 2;
+        // Beyond this error the rate is limited by maxAcquisitionRate instead, so a step of latency
+        // just below the hard sync threshold is caught up in a couple of seconds rather than ten
+        double acquisitionThresholdMills = 10;
+        double maxAcquisitionRate = 0.2;
+        double hardSyncThresholdMills = 200;
+    };
+
+    /**
+     * Must not be called while the audio thread updates the controller.
+     */
+    void setConfig(const Config& config) { mConfig = config; }
+    const Config& getConfig() const { return mConfig; }
+
+    bool isHardSyncNeeded(double errorMills) const;
+
+    /**
+     * Update with the error before rendering the frames.
+     * @return frames to skip per frame rendered, negative to repeat them
+     */
+    double update(double errorMills, int32_t numFrames, int32_t sampleRate);
+
+    /**
+     * The position has jumped by the error. The integral, which compensates the clock drift, stays.
+     */
+    void onHardSync() { mRate = 0; }
+
+    void reset();
+
+    double getRate() const { return mRate; }
+
+private:
+    Config mConfig;
+    double mErrorIntegral = 0; // seconds of error times seconds
+    double mRate = 0;
+};
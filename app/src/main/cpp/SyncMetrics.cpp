@@ -0,0 +1,115 @@
+#include "SyncMetrics.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Ratio of the bucket bounds, a value in the middle of a bucket is within kRelativeAccuracy of any
+// value counted in it
+static const double kBucketGamma = (1 + SyncMetrics::kRelativeAccuracy) / (1 - SyncMetrics::kRelativeAccuracy);
+static const double kLogBucketGamma = std::log(kBucketGamma);
+
+constexpr double SyncMetrics::kLockThresholdMills;
+constexpr double SyncMetrics::kRelativeAccuracy;
+constexpr double SyncMetrics::kLockHoldMills;
+
+void SyncMetrics::recordFirstSample(double presentationMills) {
+    if (mPlayRequestMills.load() >= 0 && mFirstSampleMills.load() < 0) {
+        mFirstSampleMills = presentationMills;
+    }
+}
+
+void SyncMetrics::recordError(double errorMills, double presentationMills, int32_t numFrames, int32_t sampleRate) {
+    // Single writer, so the counters don't need read-modify-write operations
+    double absErrorMills = std::abs(errorMills);
+    std::atomic<int64_t> &bucket = mErrorHistogram[getBucket(absErrorMills)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (absErrorMills > mMaxErrorMills.load(std::memory_order_relaxed)) {
+        mMaxErrorMills.store(absErrorMills, std::memory_order_relaxed);
+    }
+
+    int64_t micros = static_cast<int64_t>(numFrames) * 1000000 / sampleRate;
+    mPlayingMicros.store(mPlayingMicros.load(std::memory_order_relaxed) + micros, std::memory_order_relaxed);
+    if (absErrorMills <= kLockThresholdMills) {
+        mLockedMicros.store(mLockedMicros.load(std::memory_order_relaxed) + micros, std::memory_order_relaxed);
+    }
+
+    if (mFirstSampleMills.load() >= 0 && mLockMills.load() < 0) {
+        if (absErrorMills > kLockThresholdMills) {
+            mLockCandidateMills = -1;
+        } else if (mLockCandidateMills < 0) {
+            mLockCandidateMills = presentationMills;
+        } else if (presentationMills - mLockCandidateMills >= kLockHoldMills) {
+            mLockMills = mLockCandidateMills;
+        }
+    }
+}
+
+void SyncMetrics::add(const SyncMetrics& other) {
+    for (int i = 0; i < kBucketCount; i++) {
+        mErrorHistogram[i] += other.mErrorHistogram[i].load();
+    }
+    mMaxErrorMills = std::max(mMaxErrorMills.load(), other.mMaxErrorMills.load());
+    mSoftCorrections += other.mSoftCorrections.load();
+    mHardCorrections += other.mHardCorrections.load();
+    mLockedMicros += other.mLockedMicros.load();
+    mPlayingMicros += other.mPlayingMicros.load();
+
+    // The start is the one of the first playback
+    if (mPlayRequestMills.load() < 0) {
+        mPlayRequestMills = other.mPlayRequestMills.load();
+        mFirstSampleMills = other.mFirstSampleMills.load();
+        mLockMills = other.mLockMills.load();
+    }
+}
+
+SyncMetrics::Snapshot SyncMetrics::getSnapshot() const {
+    // The quantiles are taken from a copy, so they agree with each other while the errors are recorded
+    int64_t histogram[kBucketCount];
+    int64_t errorCount = 0;
+    for (int i = 0; i < kBucketCount; i++) {
+        histogram[i] = mErrorHistogram[i].load(std::memory_order_relaxed);
+        errorCount += histogram[i];
+    }
+
+    Snapshot snapshot;
+    snapshot.maxMills = mMaxErrorMills.load(std::memory_order_relaxed);
+    snapshot.p50Mills = std::min(snapshot.maxMills, getQuantile(histogram, errorCount, 0.5));
+    snapshot.p99Mills = std::min(snapshot.maxMills, getQuantile(histogram, errorCount, 0.99));
+    snapshot.softCorrections = mSoftCorrections.load(std::memory_order_relaxed);
+    snapshot.hardCorrections = mHardCorrections.load(std::memory_order_relaxed);
+    snapshot.lockedSeconds = mLockedMicros.load(std::memory_order_relaxed) / 1e6;
+    snapshot.playingSeconds = mPlayingMicros.load(std::memory_order_relaxed) / 1e6;
+
+    double requestMills = mPlayRequestMills.load();
+    double firstSampleMills = mFirstSampleMills.load();
+    double lockMills = mLockMills.load();
+    if (requestMills >= 0 && firstSampleMills >= 0) snapshot.timeToFirstSampleMills = firstSampleMills - requestMills;
+    if (requestMills >= 0 && lockMills >= 0) snapshot.timeToLockMills = lockMills - requestMills;
+    return snapshot;
+}
+
+int SyncMetrics::getBucket(double errorMills) {
+    if (errorMills < kMinErrorMills) return 0;
+    auto bucket = 1 + static_cast<int>(std::log(errorMills / kMinErrorMills) / kLogBucketGamma);
+    return std::min(bucket, kBucketCount - 1);
+}
+
+/**
+ * Bucket i > 0 counts the errors in [kMinErrorMills * gamma^(i - 1), kMinErrorMills * gamma^i)
+ */
+double SyncMetrics::getBucketValue(int bucket) {
+    if (bucket == 0) return 0;
+    return kMinErrorMills * std::pow(kBucketGamma, bucket) * 2 / (kBucketGamma + 1);
+}
+
+double SyncMetrics::getQuantile(const int64_t *histogram, int64_t errorCount, double quantile) {
+    if (errorCount == 0) return 0;
+
+    auto rank = static_cast<int64_t>(quantile * (errorCount - 1));
+    int64_t count = 0;
+    for (int i = 0; i < kBucketCount; i++) {
+        count += histogram[i];
+        if (count > rank) return getBucketValue(i);
+    }
+    return getBucketValue(kBucketCount - 1);
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Quality of the synchronization of a playback: the error between the position estimated to be
+ * presented and the target one, recorded at every callback, the corrections made and the time the
+ * error stays within `kLockThresholdMills`. The start is measured by the time from the play request
+ * to the presentation of the first sample and to the lock, which is the first time the error stays
+ * within the threshold for `kLockHoldMills`.
+ *
+ * The absolute errors are counted in a fixed log-bucketed histogram, a quantile sketch with
+ * `kRelativeAccuracy`, so recording is constant time and never allocates. The metrics are recorded
+ * by a single audio thread and read from any other one.
+ */
+class SyncMetrics {
+public:
+    // The playback is in lock while its error doesn't exceed this one
+    static constexpr double kLockThresholdMills = 2;
+    static constexpr double kLockHoldMills = 1000;
+    static constexpr double kRelativeAccuracy = 0.01;
+
+    struct Snapshot {
+        double p50Mills = 0;
+        double p99Mills = 0;
+        double maxMills = 0;
+        int64_t softCorrections = 0;
+        int64_t hardCorrections = 0;
+        double lockedSeconds = 0;
+        double playingSeconds = 0;
+        // -1 until it happens
+        double timeToFirstSampleMills = -1;
+        double timeToLockMills = -1;
+    };
+
+    /**
+     * Set when the playback was requested, in the time base of the stream. Must be called before
+     * the audio thread starts the playback.
+     */
+    void setPlayRequestMills(double requestMills) { mPlayRequestMills = requestMills; }
+
+    /**
+     * Audio thread: the first sample of the playback is presented at the time.
+     */
+    void recordFirstSample(double presentationMills);
+
+    /**
+     * Audio thread: record the error of a callback rendering the frames, the first of which is
+     * presented at the time.
+     */
+    void recordError(double errorMills, double presentationMills, int32_t numFrames, int32_t sampleRate);
+
+    /**
+     * Audio thread: count a correction of the position.
+     */
+    void countSoftCorrection() { mSoftCorrections.store(mSoftCorrections.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+    void countHardCorrection() { mHardCorrections.store(mHardCorrections.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+
+    /**
+     * Add the metrics of another playback, e.g. of a stream which has been replaced. Must not be
+     * called while this one is being recorded.
+     */
+    void add(const SyncMetrics& other);
+
+    Snapshot getSnapshot() const;
+
+private:
+    static constexpr int kBucketCount = 1024;
+    // Errors below it fall into the first bucket, the last one is reached at hours
+    static constexpr double kMinErrorMills = 0.01;
+
+    static int getBucket(double errorMills);
+    static double getBucketValue(int bucket);
+    static double getQuantile(const int64_t *histogram, int64_t errorCount, double quantile);
+
+    std::atomic<int64_t> mErrorHistogram[kBucketCount] = {};
+    std::atomic<double> mMaxErrorMills {0};
+    std::atomic<int64_t> mSoftCorrections {0};
+    std::atomic<int64_t> mHardCorrections {0};
+    std::atomic<int64_t> mLockedMicros {0};
+    std::atomic<int64_t> mPlayingMicros {0};
+
+    std::atomic<double> mPlayRequestMills {-1};
+    std::atomic<double> mFirstSampleMills {-1};
+    std::atomic<double> mLockMills {-1};
+    double mLockCandidateMills = -1; // owned by the audio thread
+};
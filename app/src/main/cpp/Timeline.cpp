@@ -0,0 +1,209 @@
+#include "Timeline.h"
+#include "logging_macros.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// How often the loader checks where the playback is
+static constexpr int64_t kLoaderIntervalMills = 50;
+
+constexpr int32_t Timeline::kGap;
+
+Timeline::Timeline(int32_t sampleRate, int64_t originMills)
+        : mSampleRate(sampleRate), mOriginMills(originMills) {}
+
+Timeline::~Timeline() {
+    {
+        std::lock_guard<std::mutex> lock(mLoaderLock);
+        mIsLoaderStopping = true;
+    }
+    mLoaderCondition.notify_all();
+    if (mLoaderThread.joinable()) {
+        mLoaderThread.join();
+    }
+    for (auto& track : mTracks) {
+        unmap(*track);
+    }
+}
+
+int32_t Timeline::addTrack(const std::string& filePath, int32_t channelCount) {
+    struct stat fileStat;
+    if (stat(filePath.c_str(), &fileStat) != 0) {
+        LOGE("Timeline: can't read %s", filePath.c_str());
+        return -1;
+    }
+
+    auto track = std::make_unique<Track>();
+    track->filePath = filePath;
+    track->channelCount = channelCount;
+    track->frames = fileStat.st_size / (channelCount * static_cast<int64_t>(sizeof(int16_t)));
+    mTracks.push_back(std::move(track));
+    return getTrackCount() - 1;
+}
+
+int32_t Timeline::addTrack(std::shared_ptr<char> buffer, int32_t channelCount, int64_t frames) {
+    auto track = std::make_unique<Track>();
+    track->channelCount = channelCount;
+    track->frames = frames;
+    track->samples = reinterpret_cast<const int16_t*>(buffer.get());
+    track->buffer = std::move(buffer);
+    mTracks.push_back(std::move(track));
+    return getTrackCount() - 1;
+}
+
+bool Timeline::addEntry(int32_t trackIndex, int64_t startFrame, int64_t frames, int32_t repeatCount) {
+    bool isGap = trackIndex == kGap;
+    if (frames <= 0 || repeatCount <= 0
+            || (!isGap && (trackIndex < 0 || trackIndex >= getTrackCount()))
+            || (!isGap && (startFrame < 0 || startFrame + frames > mTracks[trackIndex]->frames))) {
+        LOGE("Timeline: entry out of the track: track %d, frames %lld + %lld",
+                trackIndex, static_cast<long long>(startFrame), static_cast<long long>(frames));
+        return false;
+    }
+    mEntries.push_back(Entry {trackIndex, isGap ? 0 : startFrame, frames, repeatCount});
+    return true;
+}
+
+bool Timeline::compile() {
+    TRACE_SCOPE("Timeline::compile");
+    mEntryStartFrames.assign(1, 0);
+    for (const Entry& entry : mEntries) {
+        mEntryStartFrames.push_back(mEntryStartFrames.back() + entry.frames * entry.repeatCount);
+    }
+    mPeriodFrames = mEntryStartFrames.back();
+    if (getPeriodMills() == 0) {
+        LOGE("Timeline: the schedule is empty");
+        return false;
+    }
+
+    bool hasFileTracks = std::any_of(mTracks.begin(), mTracks.end(), [](const std::unique_ptr<Track>& track) {
+        return !track->filePath.empty();
+    });
+    if (hasFileTracks) {
+        mLoaderThread = std::thread(&Timeline::runLoader, this);
+    }
+    return true;
+}
+
+Timeline::Location Timeline::locate(int64_t scheduleFrame) const {
+    // The last start not after the frame
+    auto next = std::upper_bound(mEntryStartFrames.begin(), mEntryStartFrames.end() - 1, scheduleFrame);
+    size_t entryIndex = next - mEntryStartFrames.begin() - 1;
+    const Entry& entry = mEntries[entryIndex];
+
+    int64_t repeatFrame = (scheduleFrame - mEntryStartFrames[entryIndex]) % entry.frames;
+    return Location {entryIndex, entry.trackIndex, entry.startFrame + repeatFrame, entry.frames - repeatFrame};
+}
+
+int64_t Timeline::getPositionMills(int64_t serverTimeMills) const {
+    int64_t periodMills = getPeriodMills();
+    int64_t positionMills = (serverTimeMills - mOriginMills) % periodMills;
+    return positionMills < 0 ? positionMills + periodMills : positionMills;
+}
+
+bool Timeline::prefetch(int64_t scheduleFrame) {
+    TRACE_SCOPE("Timeline::prefetch");
+    std::lock_guard<std::mutex> lock(mLoaderLock);
+    return updateMappings(scheduleFrame);
+}
+
+const int16_t *Timeline::acquireTrack(int32_t trackIndex) {
+    Track& track = *mTracks[trackIndex];
+    // Announce the use before loading the samples, so the loader either sees the user or unmaps first
+    track.users++;
+    const int16_t *samples = track.samples.load();
+    if (!samples) {
+        track.users--;
+    }
+    return samples;
+}
+
+void Timeline::releaseTrack(int32_t trackIndex) {
+    mTracks[trackIndex]->users--;
+}
+
+void Timeline::runLoader() {
+    std::unique_lock<std::mutex> lock(mLoaderLock);
+    int64_t missedFrames = 0;
+    while (!mIsLoaderStopping) {
+        updateMappings(mPlayheadFrame.load() % mPeriodFrames);
+        if (mMissedFrames != missedFrames) {
+            missedFrames = mMissedFrames;
+            LOGW("Timeline: %lld frames played silent waiting for their track", static_cast<long long>(missedFrames));
+        }
+        mLoaderCondition.wait_for(lock, std::chrono::milliseconds(kLoaderIntervalMills),
+                [this] { return mIsLoaderStopping; });
+    }
+}
+
+/**
+ * Keep the track of the entry at the frame and the track of the next entry which isn't a gap
+ * mapped, unmap the rest. Must be called under the loader lock.
+ * @return false if one of the two can't be mapped
+ */
+bool Timeline::updateMappings(int64_t scheduleFrame) {
+    size_t entryIndex = locate(scheduleFrame).entryIndex;
+    int32_t currentTrack = mEntries[entryIndex].trackIndex;
+    int32_t nextTrack = kGap;
+    for (size_t i = 1; i <= mEntries.size() && nextTrack == kGap; i++) {
+        nextTrack = mEntries[(entryIndex + i) % mEntries.size()].trackIndex;
+    }
+
+    bool isMapped = true;
+    for (int32_t trackIndex = 0; trackIndex < getTrackCount(); trackIndex++) {
+        Track& track = *mTracks[trackIndex];
+        if (track.filePath.empty()) continue;
+
+        bool isNeeded = trackIndex == currentTrack || trackIndex == nextTrack;
+        if (isNeeded && !track.mapping && !track.isFailed) {
+            // The file doesn't change for the timeline, so the loader doesn't retry it every round
+            track.isFailed = !map(track);
+        } else if (!isNeeded && track.mapping) {
+            unmap(track);
+        }
+        if (isNeeded && track.isFailed) {
+            isMapped = false;
+        }
+    }
+    return isMapped;
+}
+
+bool Timeline::map(Track& track) {
+    TRACE_SCOPE("Timeline::map");
+    int fd = open(track.filePath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        LOGE("Timeline: can't open %s", track.filePath.c_str());
+        return false;
+    }
+
+    // Populated up front, so the audio thread doesn't fault the pages in
+    size_t size = track.frames * track.channelCount * sizeof(int16_t);
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        LOGE("Timeline: can't map %s", track.filePath.c_str());
+        return false;
+    }
+
+    LOGD("Timeline: mapped %s", track.filePath.c_str());
+    track.mapping = mapping;
+    track.samples = static_cast<const int16_t*>(mapping);
+    return true;
+}
+
+void Timeline::unmap(Track& track) {
+    if (!track.mapping) return;
+
+    track.samples = nullptr;
+    while (track.users.load() > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    munmap(track.mapping, track.frames * track.channelCount * sizeof(int16_t));
+    track.mapping = nullptr;
+    LOGD("Timeline: unmapped %s", track.filePath.c_str());
+}
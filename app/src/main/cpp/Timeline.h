@@ -0,0 +1,150 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * The global schedule every device plays: entries playing a range of a track, possibly several
+ * times in a row, or a gap of silence, one after another. The whole schedule repeats from the
+ * origin time, which is in the server time base.
+ *
+ * Entries are located by a binary search over the prefix sums of their durations, which are built
+ * by `compile`. The timeline can't be changed afterwards, so it is read from the audio threads
+ * without locks.
+ *
+ * Tracks of raw I16 PCM files are mapped by a loader thread only while they play or are the next
+ * ones to play, so the next track is already in memory when the playback reaches it. A track is
+ * unmapped only once no audio thread uses it, in the same way as `DefaultDataCallback::setGraph`.
+ */
+class Timeline {
+public:
+    static constexpr int32_t kGap = -1;
+
+    struct Location {
+        size_t entryIndex;
+        int32_t trackIndex;       // kGap for silence
+        int64_t trackFrame;
+        int64_t framesToBoundary; // until the entry, or its current repeat, ends
+    };
+
+    Timeline(int32_t sampleRate, int64_t originMills);
+    ~Timeline();
+
+    /**
+     * Add a track of a raw I16 PCM file, mapped only around its playback.
+     * @return index of the track or -1 if the file can't be read
+     */
+    int32_t addTrack(const std::string& filePath, int32_t channelCount);
+
+    /**
+     * Add a track already in memory, which stays there.
+     * @return index of the track
+     */
+    int32_t addTrack(std::shared_ptr<char> buffer, int32_t channelCount, int64_t frames);
+
+    /**
+     * Append an entry playing the track frames [startFrame, startFrame + frames) repeatCount times
+     * in a row, or silence for a kGap track.
+     * @return false if the range is out of the track
+     */
+    bool addEntry(int32_t trackIndex, int64_t startFrame, int64_t frames, int32_t repeatCount = 1);
+
+    /**
+     * Build the index and start the loader, @return false if the schedule is empty
+     */
+    bool compile();
+
+    /**
+     * @return where the schedule is at the frame, which must be less than the period, in O(log n)
+     */
+    Location locate(int64_t scheduleFrame) const;
+
+    int32_t getSampleRate() const { return mSampleRate; }
+    int64_t getPeriodFrames() const { return mPeriodFrames; }
+
+    /**
+     * The synchronization works in whole milliseconds, so the schedule period is rounded down to
+     * them, the tail of the last entry shorter than a millisecond is not played.
+     */
+    int64_t getPeriodMills() const { return mPeriodFrames * 1000 / mSampleRate; }
+
+    /**
+     * @return position in the schedule which plays at the server time
+     */
+    int64_t getPositionMills(int64_t serverTimeMills) const;
+
+    int32_t getTrackCount() const { return static_cast<int32_t>(mTracks.size()); }
+    int32_t getTrackChannelCount(int32_t trackIndex) const { return mTracks[trackIndex]->channelCount; }
+
+    /**
+     * Map the tracks needed at the schedule frame on the calling thread, so the playback starting
+     * there doesn't wait for the loader.
+     * @return false if a track needed there can't be mapped, it plays as silence
+     */
+    bool prefetch(int64_t scheduleFrame);
+
+    /**
+     * Audio thread: tell the loader where the playback is.
+     */
+    void setPlayhead(int64_t scheduleFrame) { mPlayheadFrame.store(scheduleFrame); }
+
+    /**
+     * Audio thread: @return the track samples or nullptr if they are not mapped, the playback has
+     * jumped faster than the loader. A non-null result must be released.
+     */
+    const int16_t *acquireTrack(int32_t trackIndex);
+    void releaseTrack(int32_t trackIndex);
+
+    /**
+     * Audio thread: count the frames played as silence as their track wasn't mapped.
+     */
+    void addMissedFrames(int32_t numFrames) { mMissedFrames += numFrames; }
+    int64_t getMissedFrames() const { return mMissedFrames; }
+
+private:
+    struct Track {
+        std::string filePath; // empty for tracks in memory
+        int32_t channelCount;
+        int64_t frames;
+        std::shared_ptr<char> buffer;
+        std::atomic<const int16_t*> samples {nullptr};
+        std::atomic<int32_t> users {0};
+        void *mapping = nullptr; // owned by the loader
+        bool isFailed = false;   // owned by the loader, not mapped again once it couldn't be
+    };
+
+    struct Entry {
+        int32_t trackIndex;
+        int64_t startFrame;
+        int64_t frames;
+        int32_t repeatCount;
+    };
+
+    void runLoader();
+    bool updateMappings(int64_t scheduleFrame);
+    bool map(Track& track);
+    void unmap(Track& track);
+
+    const int32_t mSampleRate;
+    const int64_t mOriginMills;
+
+    std::vector<std::unique_ptr<Track>> mTracks;
+    std::vector<Entry> mEntries;
+    // mEntryStartFrames[i] is the schedule frame entry i starts at, the last one is the period
+    std::vector<int64_t> mEntryStartFrames;
+    int64_t mPeriodFrames = 0;
+
+    std::atomic<int64_t> mPlayheadFrame {0};
+    std::atomic<int64_t> mMissedFrames {0};
+
+    std::mutex mLoaderLock;
+    std::condition_variable mLoaderCondition;
+    bool mIsLoaderStopping = false;
+    std::thread mLoaderThread;
+};
@@ -0,0 +1,136 @@
+#include "Trace.h"
+
+#include <atomic>
+#include <chrono>
+
+#ifdef __ANDROID__
+
+#include <android/trace.h>
+#include <dlfcn.h>
+
+// ATrace_setCounter is only available since API 29, while the app supports API 24
+using SetCounterFunction = void (*)(const char *, int64_t);
+
+static SetCounterFunction loadSetCounter() {
+    void *library = dlopen("libandroid.so", RTLD_NOW | RTLD_NOLOAD);
+    return library ? reinterpret_cast<SetCounterFunction>(dlsym(library, "ATrace_setCounter")) : nullptr;
+}
+
+namespace trace {
+
+bool isEnabled() {
+    return ATrace_isEnabled();
+}
+
+int64_t beginSection(const char *name) {
+    ATrace_beginSection(name);
+    return 0;
+}
+
+void endSection(const char *name, int64_t beginNanos) {
+    ATrace_endSection();
+}
+
+void setCounter(const char *name, int64_t value) {
+    static const SetCounterFunction setCounterFunction = loadSetCounter();
+    if (setCounterFunction) setCounterFunction(name, value);
+}
+
+} // namespace trace
+
+#else
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <thread>
+
+static constexpr size_t kMaxEvents = 1 << 20;
+
+namespace {
+
+struct Event {
+    const char *name;
+    char phase; // 'X' for a complete span, 'C' for a counter
+    uint64_t threadId;
+    int64_t timestampNanos;
+    int64_t value; // span duration or counter value
+};
+
+std::atomic_bool sIsEnabled {false};
+std::unique_ptr<Event[]> sEvents;
+std::atomic<size_t> sEventCount {0};
+
+void record(const char *name, char phase, int64_t timestampNanos, int64_t value) {
+    size_t index = sEventCount.fetch_add(1, std::memory_order_relaxed);
+    if (index >= kMaxEvents) return;
+
+    static thread_local const uint64_t threadId = std::hash<std::thread::id>()(std::this_thread::get_id()) & 0xffffffu;
+    sEvents[index] = Event { name, phase, threadId, timestampNanos, value };
+}
+
+} // namespace
+
+namespace trace {
+
+bool isEnabled() {
+    return sIsEnabled.load(std::memory_order_relaxed);
+}
+
+void setEnabled(bool isEnabled) {
+    if (isEnabled && !sEvents) {
+        sEvents.reset(new Event[kMaxEvents]);
+    }
+    sIsEnabled = isEnabled;
+}
+
+int64_t beginSection(const char *name) {
+    return nowNanos();
+}
+
+void endSection(const char *name, int64_t beginNanos) {
+    record(name, 'X', beginNanos, nowNanos() - beginNanos);
+}
+
+void setCounter(const char *name, int64_t value) {
+    record(name, 'C', nowNanos(), value);
+}
+
+// Expected to be called once recording is stopped
+bool writeChromeJson(const char *filePath) {
+    FILE *fp = fopen(filePath, "w");
+    if (!fp) return false;
+
+    size_t count = std::min(sEventCount.load(), kMaxEvents);
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (size_t i = 0; i < count; ++i) {
+        const Event &event = sEvents[i];
+        if (event.phase == 'X') {
+            fprintf(fp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f}",
+                    event.name,
+                    static_cast<unsigned long long>(event.threadId),
+                    event.timestampNanos / 1000.0,
+                    event.value / 1000.0);
+        } else {
+            fprintf(fp, "{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f,\"args\":{\"value\":%lld}}",
+                    event.name,
+                    static_cast<unsigned long long>(event.threadId),
+                    event.timestampNanos / 1000.0,
+                    static_cast<long long>(event.value));
+        }
+        fprintf(fp, i + 1 < count ? ",\n" : "\n");
+    }
+    fprintf(fp, "],\"displayTimeUnit\":\"ms\"}\n");
+
+    return fclose(fp) == 0;
+}
+
+} // namespace trace
+
+#endif
+
+int64_t trace::nowNanos() {
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
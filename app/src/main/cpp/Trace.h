@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * Trace spans and counters for the native audio path.
+ *
+ * On Android they go to ATrace, so they show up in Perfetto and systrace captures, and cost a single
+ * check while no capture is running. Host builds record them into a lock-free buffer which can be
+ * dumped as Chrome trace JSON, viewable in Perfetto UI or chrome://tracing.
+ *
+ * Building without PEREMEN_TRACING compiles all the macros out. Names must be string literals.
+ */
+namespace trace {
+
+bool isEnabled();
+
+/**
+ * @return timestamp the matching endSection takes, only host builds take one as ATrace times the
+ * sections itself
+ */
+int64_t beginSection(const char *name);
+void endSection(const char *name, int64_t beginNanos);
+void setCounter(const char *name, int64_t value);
+
+int64_t nowNanos();
+
+#ifndef __ANDROID__
+/**
+ * Start or stop recording on host. The buffer is preallocated once, events beyond its capacity are dropped.
+ */
+void setEnabled(bool isEnabled);
+
+/**
+ * Write the recorded events in Chrome trace event format.
+ * @return false if the file can't be written
+ */
+bool writeChromeJson(const char *filePath);
+#endif
+
+class Scope {
+public:
+    explicit Scope(const char *name) : mName(isEnabled() ? name : nullptr) {
+        if (mName) mBeginNanos = beginSection(mName);
+    }
+
+    ~Scope() {
+        if (mName) endSection(mName, mBeginNanos);
+    }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    const char *mName;
+    int64_t mBeginNanos = 0;
+};
+
+} // namespace trace
+
+#ifdef PEREMEN_TRACING
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) trace::Scope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_COUNTER(name, value) do { if (trace::isEnabled()) trace::setCounter(name, value); } while (0)
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_COUNTER(name, value) do {} while (0)
+#endif
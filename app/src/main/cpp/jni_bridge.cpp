@@ -15,9 +15,13 @@
  */
 
 #include <jni.h>
+#include <android/asset_manager_jni.h>
 #include <codecvt>
+#include <vector>
 #include <oboe/Oboe.h>
 #include "OboeEngine.h"
+#include "PcmCacheBuilder.h"
+#include "Timeline.h"
 #include "logging_macros.h"
 
 #define JNI_METHOD_NAME_(NAME) Java_fm_peremen_android_PlaybackEngine_##NAME
@@ -128,21 +132,96 @@ JNI_METHOD_NAME_(native_1setDefaultStreamValues)(
 }
 
 JNIEXPORT void JNICALL
-JNI_METHOD_NAME_(native_1prepare)(
+JNI_METHOD_NAME_(native_1setLatencyProfilePath)(
         JNIEnv *env,
         jclass type,
-        jlong engineHandle,
         jstring jfilePath) {
-    std::string filePath = StdStringFromJstring(env, jfilePath);
-    LOGD("prepare: %s", filePath.c_str());
+    OboeEngine::setLatencyProfilePath(StdStringFromJstring(env, jfilePath));
+}
+
+JNIEXPORT void JNICALL
+JNI_METHOD_NAME_(native_1setOutputRouteType)(
+        JNIEnv *env,
+        jclass type,
+        jint routeType) {
+    OboeEngine::setOutputRouteType(routeType);
+}
+
+/**
+ * Build the timeline of the PCM files trackPaths, every entry takes 4 values: track index or -1
+ * for a gap, start frame, frames and repeat count.
+ * @return false if a track can't be read, an entry is out of its track or the sample rate isn't
+ * the stream one
+ */
+JNIEXPORT jboolean JNICALL
+JNI_METHOD_NAME_(native_1setTimeline)(
+        JNIEnv *env,
+        jclass type,
+        jlong engineHandle,
+        jobjectArray jtrackPaths,
+        jintArray jchannelCounts,
+        jlongArray jentries,
+        jint sampleRate,
+        jlong originMills) {
 
     OboeEngine *engine = reinterpret_cast<OboeEngine*>(engineHandle);
     if (engine == nullptr) {
         LOGE("Engine is null, you must call createEngine before calling this method");
-        return;
+        return JNI_FALSE;
+    }
+
+    auto timeline = std::make_shared<Timeline>(sampleRate, originMills);
+    jsize trackCount = env->GetArrayLength(jtrackPaths);
+    std::vector<jint> channelCounts(trackCount);
+    env->GetIntArrayRegion(jchannelCounts, 0, trackCount, channelCounts.data());
+    for (jsize i = 0; i < trackCount; i++) {
+        auto jtrackPath = static_cast<jstring>(env->GetObjectArrayElement(jtrackPaths, i));
+        std::string trackPath = StdStringFromJstring(env, jtrackPath);
+        env->DeleteLocalRef(jtrackPath);
+        LOGD("setTimeline: track %s, channelCount: %d", trackPath.c_str(), channelCounts[i]);
+        if (timeline->addTrack(trackPath, channelCounts[i]) < 0) return JNI_FALSE;
+    }
+
+    std::vector<jlong> entries(env->GetArrayLength(jentries));
+    env->GetLongArrayRegion(jentries, 0, static_cast<jsize>(entries.size()), entries.data());
+    for (size_t i = 0; i + 3 < entries.size(); i += 4) {
+        if (!timeline->addEntry(static_cast<int32_t>(entries[i]), entries[i + 1], entries[i + 2],
+                static_cast<int32_t>(entries[i + 3]))) {
+            return JNI_FALSE;
+        }
+    }
+    if (!timeline->compile()) return JNI_FALSE;
+
+    return engine->setTimeline(std::move(timeline)) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jboolean JNICALL
+JNI_METHOD_NAME_(native_1prefetch)(
+        JNIEnv *env,
+        jclass type,
+        jlong engineHandle,
+        jlong serverTimeMills) {
+
+    OboeEngine *engine = reinterpret_cast<OboeEngine*>(engineHandle);
+    if (engine == nullptr) {
+        LOGE("Engine is null, you must call createEngine before calling this method");
+        return JNI_FALSE;
     }
+    return engine->prefetch(serverTimeMills) ? JNI_TRUE : JNI_FALSE;
+}
 
-    engine->prepare(filePath);
+JNIEXPORT void JNICALL
+JNI_METHOD_NAME_(native_1standBy)(
+        JNIEnv *env,
+        jclass type,
+        jlong engineHandle) {
+
+    OboeEngine *engine = reinterpret_cast<OboeEngine*>(engineHandle);
+    if (engine == nullptr) {
+        LOGE("Engine is null, you must call createEngine before calling this method");
+        return;
+    }
+    engine->standBy();
 }
 
 JNIEXPORT void JNICALL
@@ -150,16 +229,30 @@ JNI_METHOD_NAME_(native_1play)(
         JNIEnv *env,
         jclass type,
         jlong engineHandle,
-        jlong offset,
-        jlong size) {
-    LOGD("play: %ld", offset);
+        jlong serverTimeMills) {
+    LOGD("play: %lld", static_cast<long long>(serverTimeMills));
 
     OboeEngine *engine = reinterpret_cast<OboeEngine*>(engineHandle);
     if (engine == nullptr) {
         LOGE("Engine is null, you must call createEngine before calling this method");
         return;
     }
-    engine->play(offset, size);
+    engine->play(serverTimeMills);
+}
+
+JNIEXPORT jlong JNICALL
+JNI_METHOD_NAME_(native_1getTimelinePositionMillis)(
+        JNIEnv *env,
+        jclass type,
+        jlong engineHandle,
+        jlong serverTimeMills) {
+
+    OboeEngine *engine = reinterpret_cast<OboeEngine*>(engineHandle);
+    if (engine == nullptr) {
+        LOGE("Engine is null, you must call createEngine before calling this method");
+        return static_cast<jlong>(-1);
+    }
+    return static_cast<jlong>(engine->getTimelinePositionMills(serverTimeMills));
 }
 
 JNIEXPORT void JNICALL
@@ -177,4 +270,210 @@ JNI_METHOD_NAME_(native_1setPlaybackShift)(
     engine->setPlaybackShift(playbackShift);
 }
 
+JNIEXPORT void JNICALL
+JNI_METHOD_NAME_(native_1setPeerSyncEnabled)(
+        JNIEnv *env,
+        jclass type,
+        jlong engineHandle,
+        jboolean isEnabled) {
+
+    OboeEngine *engine = reinterpret_cast<OboeEngine*>(engineHandle);
+    if (engine == nullptr) {
+        LOGE("Engine is null, you must call createEngine before calling this method");
+        return;
+    }
+    engine->setPeerSyncEnabled(isEnabled);
+}
+
+JNIEXPORT jint JNICALL
+JNI_METHOD_NAME_(native_1getPeerCount)(
+        JNIEnv *env,
+        jclass,
+        jlong engineHandle) {
+
+    OboeEngine *engine = reinterpret_cast<OboeEngine*>(engineHandle);
+    if (engine == nullptr) {
+        LOGE("Engine is null, you must call createEngine before calling this method");
+        return static_cast<jint>(0);
+    }
+    return static_cast<jint>(engine->getPeerCount());
+}
+
+JNIEXPORT void JNICALL
+JNI_METHOD_NAME_(native_1setPowerSavingEnabled)(
+        JNIEnv *env,
+        jclass type,
+        jlong engineHandle,
+        jboolean isEnabled) {
+
+    OboeEngine *engine = reinterpret_cast<OboeEngine*>(engineHandle);
+    if (engine == nullptr) {
+        LOGE("Engine is null, you must call createEngine before calling this method");
+        return;
+    }
+    engine->setPowerSavingEnabled(isEnabled);
+}
+
+JNIEXPORT void JNICALL
+JNI_METHOD_NAME_(native_1setPerformanceHintEnabled)(
+        JNIEnv *env,
+        jclass type,
+        jlong engineHandle,
+        jboolean isEnabled) {
+
+    OboeEngine *engine = reinterpret_cast<OboeEngine*>(engineHandle);
+    if (engine == nullptr) {
+        LOGE("Engine is null, you must call createEngine before calling this method");
+        return;
+    }
+    engine->setPerformanceHintEnabled(isEnabled);
+}
+
+JNIEXPORT void JNICALL
+JNI_METHOD_NAME_(native_1setRenderAheadMills)(
+        JNIEnv *env,
+        jclass type,
+        jlong engineHandle,
+        jint renderAheadMills) {
+
+    OboeEngine *engine = reinterpret_cast<OboeEngine*>(engineHandle);
+    if (engine == nullptr) {
+        LOGE("Engine is null, you must call createEngine before calling this method");
+        return;
+    }
+    engine->setRenderAheadMills(renderAheadMills);
+}
+
+JNIEXPORT void JNICALL
+JNI_METHOD_NAME_(native_1setSyntheticLoad)(
+        JNIEnv *env,
+        jclass type,
+        jlong engineHandle,
+        jdouble loadFraction) {
+
+    OboeEngine *engine = reinterpret_cast<OboeEngine*>(engineHandle);
+    if (engine == nullptr) {
+        LOGE("Engine is null, you must call createEngine before calling this method");
+        return;
+    }
+    engine->setSyntheticLoad(loadFraction);
+}
+
+JNIEXPORT jstring JNICALL
+JNI_METHOD_NAME_(native_1getCallbackTimingReport)(
+        JNIEnv *env,
+        jclass,
+        jlong engineHandle) {
+
+    OboeEngine *engine = reinterpret_cast<OboeEngine*>(engineHandle);
+    if (engine == nullptr) {
+        LOGE("Engine is null, you must call createEngine before calling this method");
+        return env->NewStringUTF("");
+    }
+    return env->NewStringUTF(engine->getCallbackTimingReport().c_str());
+}
+
+/**
+ * @return callbacks per second and callback CPU milliseconds per second, first for the low latency
+ * mode and then for the power saving one
+ */
+JNIEXPORT jdoubleArray JNICALL
+JNI_METHOD_NAME_(native_1getCallbackStats)(
+        JNIEnv *env,
+        jclass,
+        jlong engineHandle) {
+
+    jdouble stats[4] = {0};
+
+    OboeEngine *engine = reinterpret_cast<OboeEngine*>(engineHandle);
+    if (engine == nullptr) {
+        LOGE("Engine is null, you must call createEngine before calling this method");
+    } else {
+        engine->getCallbackStats(false, stats[0], stats[1]);
+        engine->getCallbackStats(true, stats[2], stats[3]);
+    }
+
+    jdoubleArray result = env->NewDoubleArray(4);
+    env->SetDoubleArrayRegion(result, 0, 4, stats);
+    return result;
+}
+
+/**
+ * @return p50, p99 and max of the synchronization error in milliseconds, soft and hard corrections,
+ * seconds in lock, seconds played, then milliseconds from the play call to the first sample and to
+ * the lock, -1 until they happen
+ */
+JNIEXPORT jdoubleArray JNICALL
+JNI_METHOD_NAME_(native_1getSyncMetrics)(
+        JNIEnv *env,
+        jclass,
+        jlong engineHandle) {
+
+    jdouble metrics[9] = {0, 0, 0, 0, 0, 0, 0, -1, -1};
+
+    OboeEngine *engine = reinterpret_cast<OboeEngine*>(engineHandle);
+    if (engine == nullptr) {
+        LOGE("Engine is null, you must call createEngine before calling this method");
+    } else {
+        SyncMetrics::Snapshot snapshot = engine->getSyncMetrics();
+        metrics[0] = snapshot.p50Mills;
+        metrics[1] = snapshot.p99Mills;
+        metrics[2] = snapshot.maxMills;
+        metrics[3] = snapshot.softCorrections;
+        metrics[4] = snapshot.hardCorrections;
+        metrics[5] = snapshot.lockedSeconds;
+        metrics[6] = snapshot.playingSeconds;
+        metrics[7] = snapshot.timeToFirstSampleMills;
+        metrics[8] = snapshot.timeToLockMills;
+    }
+
+    jdoubleArray result = env->NewDoubleArray(9);
+    env->SetDoubleArrayRegion(result, 0, 9, metrics);
+    return result;
+}
+
+JNIEXPORT jstring JNICALL
+JNI_METHOD_NAME_(native_1getRenderCostReport)(
+        JNIEnv *env,
+        jclass,
+        jlong engineHandle) {
+
+    OboeEngine *engine = reinterpret_cast<OboeEngine*>(engineHandle);
+    if (engine == nullptr) {
+        LOGE("Engine is null, you must call createEngine before calling this method");
+        return env->NewStringUTF("");
+    }
+    return env->NewStringUTF(engine->getRenderCostReport().c_str());
+}
+
+JNIEXPORT jintArray JNICALL
+JNI_METHOD_NAME_(native_1buildPcmCache)(
+        JNIEnv *env,
+        jclass,
+        jobject jassetManager,
+        jstring jassetName,
+        jstring joutputPath,
+        jint threadCount) {
+    PcmCacheBuilder builder(AAssetManager_fromJava(env, jassetManager), StdStringFromJstring(env, jassetName));
+    if (!builder.build(StdStringFromJstring(env, joutputPath), threadCount)) {
+        return nullptr;
+    }
+
+    jint result[3] = {builder.getSampleRate(), builder.getChannelCount(), (jint) builder.getBuildMills()};
+    jintArray array = env->NewIntArray(3);
+    env->SetIntArrayRegion(array, 0, 3, result);
+    return array;
+}
+
+JNIEXPORT jstring JNICALL
+JNI_METHOD_NAME_(native_1benchmarkPcmCache)(
+        JNIEnv *env,
+        jclass,
+        jobject jassetManager,
+        jstring jassetName,
+        jstring jscratchPath) {
+    PcmCacheBuilder builder(AAssetManager_fromJava(env, jassetManager), StdStringFromJstring(env, jassetName));
+    return env->NewStringUTF(builder.benchmark(StdStringFromJstring(env, jscratchPath)).c_str());
+}
+
 } // extern "C"
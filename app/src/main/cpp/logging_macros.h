@@ -16,9 +16,11 @@
  */
 #ifndef __SAMPLE_ANDROID_DEBUG_H__
 #define __SAMPLE_ANDROID_DEBUG_H__
+#ifdef __ANDROID__
 #include <android/log.h>
+#endif
 
-#ifdef DEBUG
+#if defined(DEBUG) && defined(__ANDROID__)
 #ifndef MODULE_NAME
 #define MODULE_NAME  "PEREMEN-FM"
 #endif
@@ -31,6 +33,19 @@
 #define LOGF(...) __android_log_print(ANDROID_LOG_FATAL, MODULE_NAME, __VA_ARGS__)
 
 #define ASSERT(cond, ...) if (!(cond)) {__android_log_assert(#cond, MODULE_NAME, __VA_ARGS__);}
+#elif defined(DEBUG)
+#include <cstdio>
+#include <cstdlib>
+
+// Host builds, e.g. the offline renderer
+#define LOGV(...) (fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#define LOGD(...) (fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#define LOGI(...) (fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#define LOGW(...) (fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#define LOGE(...) (fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#define LOGF(...) (fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+
+#define ASSERT(cond, ...) if (!(cond)) {fprintf(stderr, __VA_ARGS__); abort();}
 #else
 
 #define LOGV(...)
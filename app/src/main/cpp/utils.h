@@ -1,6 +1,9 @@
 #pragma once
 
-#include <oboe/Oboe.h>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include "IPlaybackStream.h"
 
 constexpr double kDefaultLatency = 120; //ms
 
@@ -9,27 +12,26 @@ inline double millsNow() {
     return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
 }
 
-inline double bytesPerMillisecond(const std::shared_ptr<oboe::AudioStream>& oboeStream) {
+inline double preciseMillsNow() {
+    using namespace std::chrono;
+    return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+inline double bytesPerMillisecond(const std::shared_ptr<IPlaybackStream>& oboeStream) {
     return oboeStream->getBytesPerFrame() * oboeStream->getSampleRate() / 1000.0;
 }
 
-inline int64_t millsToBytes(double mills, const std::shared_ptr<oboe::AudioStream>& oboeStream) {
+inline int64_t millsToBytes(double mills, const std::shared_ptr<IPlaybackStream>& oboeStream) {
     int64_t bytes = mills * bytesPerMillisecond(oboeStream);
     bytes = bytes / oboeStream->getBytesPerFrame() * oboeStream->getBytesPerFrame(); // align value
 
     return bytes;
 }
 
-inline int64_t millsToSamples(double mills, const std::shared_ptr<oboe::AudioStream>& oboeStream) {
-    return millsToBytes(mills, oboeStream) / oboeStream->getBytesPerSample();
-}
-
-inline int64_t millsToFrames(double mills, const std::shared_ptr<oboe::AudioStream>& oboeStream) {
+inline int64_t millsToFrames(double mills, const std::shared_ptr<IPlaybackStream>& oboeStream) {
     return millsToBytes(mills, oboeStream) / oboeStream->getBytesPerFrame();
 }
 
-inline double samplesToMills(int64_t samples, const std::shared_ptr<oboe::AudioStream>& oboeStream) {
-    int64_t bytes = samples * oboeStream->getBytesPerSample();
-    double mills = bytes / bytesPerMillisecond(oboeStream);
-    return mills;
+inline double framesToMills(int64_t frames, const std::shared_ptr<IPlaybackStream>& oboeStream) {
+    return frames * 1000.0 / oboeStream->getSampleRate();
 }
@@ -21,6 +21,7 @@ class PeremenApplication : Application(), LifecycleObserver {
 
     @OnLifecycleEvent(Lifecycle.Event.ON_STOP)
     fun onBackground() {
+        PeremenManager.isPowerSavingEnabled = true
         if (PeremenManager.isStarted) {
             PeremenService.start(this)
         }
@@ -28,6 +29,7 @@ class PeremenApplication : Application(), LifecycleObserver {
 
     @OnLifecycleEvent(Lifecycle.Event.ON_START)
     fun onForeground() {
+        PeremenManager.isPowerSavingEnabled = false
         PeremenService.stop(this)
     }
 }
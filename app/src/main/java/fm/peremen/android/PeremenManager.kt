@@ -2,7 +2,11 @@ package fm.peremen.android
 
 import android.annotation.SuppressLint
 import android.content.Context
+import android.media.AudioDeviceCallback
+import android.media.AudioDeviceInfo
+import android.media.AudioManager
 import android.media.MediaFormat
+import android.net.wifi.WifiManager
 import android.os.SystemClock
 import androidx.preference.PreferenceManager
 import fm.peremen.android.timeengine.TimeEngine
@@ -13,6 +17,7 @@ import kotlin.properties.Delegates
 
 private const val AUDIO_FILE_NAME = "peremen2.mp3"
 private const val AUDIO_FILE_NAME_PCM = "peremen2.raw"
+private const val AUDIO_FILE_NAME_PCM_REFERENCE = "peremen2_reference.raw"
 private const val AUDIO_FILE_LENGTH = 296250L
 private const val RADIO_START_TIMESTAMP = 1612384206000L
 
@@ -43,6 +48,62 @@ object PeremenManager {
     var isError = false
         private set
 
+    /**
+     * Align playback to other devices in the same local network. Takes effect on the next start.
+     */
+    var isPeerSyncEnabled = false
+
+    var peerCount: Int = 0
+        private set
+
+    /**
+     * Play through the power saving stream with large buffers, e.g. while the app is in background.
+     * The engine switches streams on the fly without losing the playback position.
+     */
+    var isPowerSavingEnabled = false
+        set(value) {
+            if (field == value) return
+            field = value
+            if (status == Status.PLAYING) {
+                logCallbackStats()
+                PlaybackEngine.setPowerSavingEnabled(value)
+            }
+        }
+
+    var isPerformanceHintEnabled = true
+        set(value) {
+            if (field == value) return
+            field = value
+            if (status == Status.PLAYING) {
+                logCallbackStats()
+                PlaybackEngine.setPerformanceHintEnabled(value)
+            }
+        }
+
+    /**
+     * Render the audio ahead of the audio callbacks on a worker thread, 0 renders it in the callbacks.
+     * Trades this much extra latency for callbacks which only copy the rendered audio.
+     */
+    var renderAheadMills = 0
+        set(value) {
+            if (field == value) return
+            field = value
+            if (status == Status.PLAYING) {
+                logCallbackStats()
+                PlaybackEngine.setRenderAheadMills(value)
+            }
+        }
+
+    /**
+     * Fraction of the audio duration burnt in busy CPU time while rendering, to benchmark the
+     * callback timing of both render modes under load
+     */
+    var syntheticLoad = 0.0
+        set(value) {
+            field = value
+            if (status == Status.PLAYING) PlaybackEngine.setSyntheticLoad(value)
+        }
+
     val onChanged = mutableListOf<() -> Unit>()
 
     private fun notifyChanged() = onChanged.forEach { it() }
@@ -59,20 +120,35 @@ object PeremenManager {
 
     private var serverOffsetOnStartPlaying: Long = 0
 
+    private var startMills: Long = 0
+
     private var serverOffset: Long = 0
 
     private lateinit var timeEngine: TimeEngine
 
+    private val multicastLock by lazy {
+        val wifiManager = context.applicationContext.getSystemService(Context.WIFI_SERVICE) as WifiManager
+        wifiManager.createMulticastLock("PeremenFM:PeerSync").apply { setReferenceCounted(false) }
+    }
+
     fun setup(context: Context) {
         this.context = context
         timeEngine = TimeEngine(context, this::updateServerOffset)
         managerScope.launch { timeEngine.start() }
+
+        // Streams reopened after a route change are keyed by the new route
+        val audioManager = context.getSystemService(Context.AUDIO_SERVICE) as AudioManager
+        audioManager.registerAudioDeviceCallback(object : AudioDeviceCallback() {
+            override fun onAudioDevicesAdded(addedDevices: Array<out AudioDeviceInfo>) = PlaybackEngine.updateOutputRoute(context)
+            override fun onAudioDevicesRemoved(removedDevices: Array<out AudioDeviceInfo>) = PlaybackEngine.updateOutputRoute(context)
+        }, null)
     }
 
     fun start() {
         if (state != State.IDLE) return
         state = State.STARTED
         isError = false
+        startMills = SystemClock.elapsedRealtime()
 
         managerScope.launch { timeEngine.start() } // update timestamp even if we already have one
 
@@ -81,8 +157,6 @@ object PeremenManager {
                 ensureCache()
 
                 status = Status.POSITIONING
-                ensureServerOffset()
-
                 play()
             } catch (e: CancellationException) {
                 Timber.d("Job cancelled")
@@ -109,56 +183,173 @@ object PeremenManager {
         if (!sharedPreferences.isAudioDecoded) {
             status = Status.DECODING
             Timber.d("Decodinig begin")
-            val mediaFormat = withContext(Dispatchers.IO) { convertMp3ToPcm(context, AUDIO_FILE_NAME, AUDIO_FILE_NAME_PCM) }
-            sharedPreferences.channelCount = mediaFormat.getInteger(MediaFormat.KEY_CHANNEL_COUNT)
-            sharedPreferences.sampleRate = mediaFormat.getInteger(MediaFormat.KEY_SAMPLE_RATE)
+            val pcmFormat = withContext(Dispatchers.IO) { PlaybackEngine.buildPcmCache(context, AUDIO_FILE_NAME, AUDIO_FILE_NAME_PCM) }
+            if (pcmFormat != null) {
+                Timber.d("Decoded natively in ${pcmFormat[2]} ms")
+                sharedPreferences.sampleRate = pcmFormat[0]
+                sharedPreferences.channelCount = pcmFormat[1]
+            } else {
+                Timber.w("Native decoding failed, decoding sequentially")
+                val mediaFormat = withContext(Dispatchers.IO) { convertMp3ToPcm(context, AUDIO_FILE_NAME, AUDIO_FILE_NAME_PCM) }
+                sharedPreferences.channelCount = mediaFormat.getInteger(MediaFormat.KEY_CHANNEL_COUNT)
+                sharedPreferences.sampleRate = mediaFormat.getInteger(MediaFormat.KEY_SAMPLE_RATE)
+            }
             sharedPreferences.isAudioDecoded = true
             Timber.d("Decodinig success")
+
+            if (BuildConfig.DEBUG) {
+                // In the background, so the first playback doesn't wait for them
+                val isNative = pcmFormat != null
+                managerScope.launch(Dispatchers.IO) { checkPcmCache(isNative) }
+            }
+        }
+    }
+
+    /**
+     * Debug checks of the native cache: its content and the time to build it on 1, 2, 4... threads.
+     */
+    private suspend fun checkPcmCache(isNative: Boolean) {
+        if (isNative) {
+            verifyPcmCache()
+        }
+        Timber.d("PCM cache benchmark:\n${PlaybackEngine.benchmarkPcmCache(context, AUDIO_FILE_NAME)}")
+    }
+
+    /**
+     * Compare the native cache with the one decoded sequentially, byte for byte.
+     */
+    private suspend fun verifyPcmCache() = withContext(Dispatchers.IO) {
+        val cache = context.getFileStreamPath(AUDIO_FILE_NAME_PCM)
+        val reference = context.getFileStreamPath(AUDIO_FILE_NAME_PCM_REFERENCE)
+        try {
+            convertMp3ToPcm(context, AUDIO_FILE_NAME, AUDIO_FILE_NAME_PCM_REFERENCE)
+            val difference = findFirstDifference(cache, reference)
+            if (difference < 0) {
+                Timber.d("PCM cache matches the sequential decoding")
+            } else {
+                Timber.e("PCM cache differs from the sequential decoding at byte $difference, sizes ${cache.length()} and ${reference.length()}")
+            }
+        } finally {
+            reference.delete()
         }
     }
 
     suspend fun ensureServerOffset() = timeEngine.ensureServerOffset()
 
     private suspend fun play() {
-        status = Status.PLAYING
-
         try {
-            val sharedPreferences = PreferenceManager.getDefaultSharedPreferences(context)
-            PlaybackEngine.setDefaultStreamValues(context, sharedPreferences.sampleRate, sharedPreferences.channelCount)
-            PlaybackEngine.create()
+            // The stream is opened, and warms up measuring its latency, while the server time is
+            // being found, so the first buffer is already in sync once it is. If finding it takes
+            // longer, the stream waits paused instead of running silent callbacks.
+            coroutineScope {
+                val engineReady = async(Dispatchers.IO) { prepareEngine() }
+                val serverOffsetReady = async { ensureServerOffset() }
+                engineReady.await()
+                if (!serverOffsetReady.isCompleted) withContext(Dispatchers.IO) { PlaybackEngine.standBy() }
+                serverOffsetReady.await()
+            }
 
-            val file = context.getFileStreamPath(AUDIO_FILE_NAME_PCM)
-            PlaybackEngine.prepare(file.absolutePath)
+            status = Status.PLAYING
+            if (isPeerSyncEnabled) {
+                multicastLock.acquire()
+                PlaybackEngine.setPeerSyncEnabled(true)
+            }
 
-            val offset = playbackOffset()
+            // The position is taken by the server time known now, so the shift is relative to it.
+            // Updates of the server time arriving while play waits for the latency are shifts
+            // already, the ones which arrived while positioning are in the start position.
             Timber.d("Playback begin")
-            PlaybackEngine.play(offset, AUDIO_FILE_LENGTH)
-
+            val playMills = SystemClock.elapsedRealtime()
+            val playServerTime = serverTime()
             serverOffsetOnStartPlaying = serverOffset
+            playbackShift = 0
+            PlaybackEngine.setPlaybackShift(playbackShift)
+            withContext(Dispatchers.IO) { PlaybackEngine.play(playServerTime) }
 
+            var isStartLogged = false
             while (true) {
                 playbackPosition = PlaybackEngine.getCurrentPositionMillis()
                 synchronizationOffset = playbackOffset() - playbackPosition
                 latency = PlaybackEngine.getCurrentOutputLatencyMillis()
                 totalPatchMills = PlaybackEngine.getTotalPathMills()
+                peerCount = PlaybackEngine.getPeerCount()
+
+                val sync = PlaybackEngine.getSyncMetrics()
+                if (!isStartLogged && sync[8] >= 0) {
+                    isStartLogged = true
+                    Timber.d("Start: play called %d ms after start, then first sample in %.0f ms, in lock in %.0f ms",
+                        playMills - startMills, sync[7], sync[8])
+                }
 
                 notifyChanged()
                 delay(1000)
             }
         } finally {
+            logCallbackStats()
             PlaybackEngine.delete()
+            if (multicastLock.isHeld) multicastLock.release()
+            peerCount = 0
+        }
+    }
+
+    /**
+     * Open the stream and map the audio around the position expected to play, by the server time
+     * known so far.
+     */
+    private fun prepareEngine() {
+        val sharedPreferences = PreferenceManager.getDefaultSharedPreferences(context)
+        PlaybackEngine.setDefaultStreamValues(context, sharedPreferences.sampleRate, sharedPreferences.channelCount)
+        PlaybackEngine.setLatencyProfilePath(context)
+        PlaybackEngine.updateOutputRoute(context)
+        PlaybackEngine.create()
+        PlaybackEngine.setPowerSavingEnabled(isPowerSavingEnabled)
+        PlaybackEngine.setPerformanceHintEnabled(isPerformanceHintEnabled)
+        PlaybackEngine.setRenderAheadMills(renderAheadMills)
+        PlaybackEngine.setSyntheticLoad(syntheticLoad)
+
+        val file = context.getFileStreamPath(AUDIO_FILE_NAME_PCM)
+        val timelineEntries = radioTimelineEntries(file.length(), sharedPreferences.sampleRate, sharedPreferences.channelCount)
+        if (!PlaybackEngine.setTimeline(arrayOf(file.absolutePath), intArrayOf(sharedPreferences.channelCount),
+                timelineEntries, sharedPreferences.sampleRate, RADIO_START_TIMESTAMP)) {
+            throw IllegalStateException("Can't set the timeline of $file")
+        }
+        if (!PlaybackEngine.prefetch(serverTime())) {
+            throw IllegalStateException("Can't map $file")
         }
     }
 
-    private fun playbackOffset(): Long {
-        val currentServerTime = SystemClock.elapsedRealtime() + serverOffset
-        val globalDuration = currentServerTime - RADIO_START_TIMESTAMP
-        return globalDuration % AUDIO_FILE_LENGTH
+    private fun logCallbackStats() {
+        val stats = PlaybackEngine.getCallbackStats()
+        Timber.d("Low latency: %.1f callbacks/s, %.3f CPU ms/s; power saving: %.1f callbacks/s, %.3f CPU ms/s",
+            stats[0], stats[1], stats[2], stats[3])
+        Timber.d("Render cost per callback: ${PlaybackEngine.getRenderCostReport()}")
+        Timber.d("Callback timing: ${PlaybackEngine.getCallbackTimingReport()}")
+        val sync = PlaybackEngine.getSyncMetrics()
+        Timber.d("Sync error: p50 %.2f ms, p99 %.2f ms, max %.2f ms; corrections: %d soft, %d hard; in lock %.1f of %.1f s; " +
+            "first sample %.0f ms and lock %.0f ms after play",
+            sync[0], sync[1], sync[2], sync[3].toLong(), sync[4].toLong(), sync[5], sync[6], sync[7], sync[8])
+    }
+
+    private fun serverTime() = SystemClock.elapsedRealtime() + serverOffset
+
+    private fun playbackOffset() = PlaybackEngine.getTimelinePositionMillis(serverTime())
+
+    /**
+     * The song repeating every AUDIO_FILE_LENGTH, a decoded file shorter than that is padded with
+     * silence, so the schedule stays the same on every device.
+     */
+    private fun radioTimelineEntries(fileBytes: Long, sampleRate: Int, channelCount: Int): LongArray {
+        val scheduleFrames = AUDIO_FILE_LENGTH * sampleRate / 1000
+        val trackFrames = minOf(scheduleFrames, fileBytes / (2 * channelCount))
+        val entries = mutableListOf(0L, 0L, trackFrames, 1L)
+        if (trackFrames < scheduleFrames) entries += listOf(-1L, 0L, scheduleFrames - trackFrames, 1L)
+        return entries.toLongArray()
     }
 
     private fun updateServerOffset(offset: Long) {
         serverOffset = offset
-        if (state != State.STARTED) return
+        // Before play captures the start offset, the shift would be relative to a stale one
+        if (state != State.STARTED || status != Status.PLAYING) return
 
         playbackShift = serverOffset - serverOffsetOnStartPlaying
         PlaybackEngine.setPlaybackShift(playbackShift)
@@ -16,10 +16,15 @@ package fm.peremen.android;
  */
 
 import android.content.Context;
+import android.content.res.AssetManager;
+import android.media.AudioDeviceInfo;
 import android.media.AudioManager;
 
 public class PlaybackEngine {
 
+    private static final String LATENCY_PROFILE_FILE_NAME = "latency_profiles.txt";
+    private static final String PCM_CACHE_BENCHMARK_FILE_NAME = "pcm_cache_benchmark.raw";
+
     static long mEngineHandle = 0;
 
     static {
@@ -42,6 +47,58 @@ public class PlaybackEngine {
         native_setDefaultStreamValues(defaultSampleRate, defaultChannelCount, defaultFramesPerBurst);
     }
 
+    /**
+     * Decode the asset into a raw PCM file in the app files on all cores.
+     * @return {sampleRate, channelCount, buildMills} or null if native decoding failed
+     */
+    static int[] buildPcmCache(Context context, String assetName, String outputFileName) {
+        return native_buildPcmCache(context.getAssets(), assetName,
+                context.getFileStreamPath(outputFileName).getAbsolutePath(), 0);
+    }
+
+    /**
+     * @return time to build the PCM cache against the number of decoding threads
+     */
+    static String benchmarkPcmCache(Context context, String assetName) {
+        return native_benchmarkPcmCache(context.getAssets(), assetName,
+                context.getFileStreamPath(PCM_CACHE_BENCHMARK_FILE_NAME).getAbsolutePath());
+    }
+
+    static void setLatencyProfilePath(Context context) {
+        native_setLatencyProfilePath(context.getFileStreamPath(LATENCY_PROFILE_FILE_NAME).getAbsolutePath());
+    }
+
+    /**
+     * Tell the engine the type of the output the system routes the media to, picking the most
+     * specific connected device the way the default routing does. The device ids of OpenSL ES streams
+     * are unspecified, so the latency profiles would mix all the routes without it.
+     */
+    static void updateOutputRoute(Context context) {
+        AudioManager audioManager = (AudioManager) context.getSystemService(Context.AUDIO_SERVICE);
+        int routeType = AudioDeviceInfo.TYPE_UNKNOWN;
+        int routePriority = Integer.MAX_VALUE;
+        for (AudioDeviceInfo device : audioManager.getDevices(AudioManager.GET_DEVICES_OUTPUTS)) {
+            int priority = getRoutePriority(device.getType());
+            if (priority < routePriority) {
+                routePriority = priority;
+                routeType = device.getType();
+            }
+        }
+        native_setOutputRouteType(routeType);
+    }
+
+    private static int getRoutePriority(int deviceType) {
+        switch (deviceType) {
+            case AudioDeviceInfo.TYPE_BLUETOOTH_A2DP: return 0;
+            case AudioDeviceInfo.TYPE_USB_HEADSET: return 1;
+            case AudioDeviceInfo.TYPE_USB_DEVICE: return 2;
+            case AudioDeviceInfo.TYPE_WIRED_HEADPHONES: return 3;
+            case AudioDeviceInfo.TYPE_WIRED_HEADSET: return 4;
+            case AudioDeviceInfo.TYPE_BUILTIN_SPEAKER: return 5;
+            default: return Integer.MAX_VALUE;
+        }
+    }
+
     static void delete(){
         if (mEngineHandle != 0){
             native_deleteEngine(mEngineHandle);
@@ -49,14 +106,48 @@ public class PlaybackEngine {
         mEngineHandle = 0;
     }
 
-    static void prepare(String filePath) {
+    /**
+     * Set the global schedule of raw PCM tracks, which repeats from originMills in server time.
+     * Every entry takes 4 values: track index or -1 for a gap, start frame, frames and repeat count.
+     * @return false if a track can't be read, an entry is out of its track or the sample rate isn't
+     * the one of the stream
+     */
+    static boolean setTimeline(String[] trackPaths, int[] channelCounts, long[] entries, int sampleRate, long originMills) {
+        if (mEngineHandle == 0) return false;
+        return native_setTimeline(mEngineHandle, trackPaths, channelCounts, entries, sampleRate, originMills);
+    }
+
+    /**
+     * Map the timeline tracks needed at the server time ahead of play
+     * @return false if there is no timeline or its tracks can't be mapped
+     */
+    static boolean prefetch(long serverTimeMills) {
+        if (mEngineHandle == 0) return false;
+        return native_prefetch(mEngineHandle, serverTimeMills);
+    }
+
+    /**
+     * Pause the stream until play once it has measured its latency, blocks for a while until it has
+     */
+    static void standBy() {
         if (mEngineHandle == 0) return;
-        native_prepare(mEngineHandle, filePath);
+        native_standBy(mEngineHandle);
     }
 
-    static void play(long offset, long size) {
+    /**
+     * Start the playback, blocks for a while if the stream hasn't measured its latency yet
+     */
+    static void play(long serverTimeMills) {
         if (mEngineHandle == 0) return;
-        native_play(mEngineHandle, offset, size);
+        native_play(mEngineHandle, serverTimeMills);
+    }
+
+    /**
+     * @return position in the timeline scheduled for the server time
+     */
+    static long getTimelinePositionMillis(long serverTimeMills) {
+        if (mEngineHandle == 0) return 0;
+        return native_getTimelinePositionMillis(mEngineHandle, serverTimeMills);
     }
 
     static void setPlaybackShift(long playbackShift) {
@@ -64,6 +155,76 @@ public class PlaybackEngine {
         native_setPlaybackShift(mEngineHandle, playbackShift);
     }
 
+    static void setPeerSyncEnabled(boolean isEnabled) {
+        if (mEngineHandle == 0) return;
+        native_setPeerSyncEnabled(mEngineHandle, isEnabled);
+    }
+
+    static int getPeerCount() {
+        if (mEngineHandle == 0) return 0;
+        return native_getPeerCount(mEngineHandle);
+    }
+
+    static void setPowerSavingEnabled(boolean isEnabled) {
+        if (mEngineHandle == 0) return;
+        native_setPowerSavingEnabled(mEngineHandle, isEnabled);
+    }
+
+    /**
+     * @return callbacks per second and callback CPU milliseconds per second, first for the low
+     * latency mode and then for the power saving one
+     */
+    static double[] getCallbackStats() {
+        if (mEngineHandle == 0) return new double[4];
+        return native_getCallbackStats(mEngineHandle);
+    }
+
+    static void setPerformanceHintEnabled(boolean isEnabled) {
+        if (mEngineHandle == 0) return;
+        native_setPerformanceHintEnabled(mEngineHandle, isEnabled);
+    }
+
+    /**
+     * Render the audio on a worker thread up to the given time ahead of the callbacks, 0 renders
+     * it in the callbacks. The engine switches streams on the fly, as for the power saving mode.
+     */
+    static void setRenderAheadMills(int renderAheadMills) {
+        if (mEngineHandle == 0) return;
+        native_setRenderAheadMills(mEngineHandle, renderAheadMills);
+    }
+
+    /**
+     * Burn the given fraction of the rendered audio duration in busy CPU time, for benchmarking
+     */
+    static void setSyntheticLoad(double loadFraction) {
+        if (mEngineHandle == 0) return;
+        native_setSyntheticLoad(mEngineHandle, loadFraction);
+    }
+
+    /**
+     * @return xruns, deadline misses and callback duration histogram with the performance hint off
+     * and on, rendering in the callbacks and ahead of them
+     */
+    static String getCallbackTimingReport() {
+        if (mEngineHandle == 0) return "";
+        return native_getCallbackTimingReport(mEngineHandle);
+    }
+
+    /**
+     * @return p50, p99 and max of the synchronization error in milliseconds, soft and hard
+     * corrections, seconds in lock, seconds played, then milliseconds from the play call to the
+     * first sample and to the lock, -1 until they happen
+     */
+    static double[] getSyncMetrics() {
+        if (mEngineHandle == 0) return new double[] {0, 0, 0, 0, 0, 0, 0, -1, -1};
+        return native_getSyncMetrics(mEngineHandle);
+    }
+
+    static String getRenderCostReport() {
+        if (mEngineHandle == 0) return "";
+        return native_getRenderCostReport(mEngineHandle);
+    }
+
     static long getCurrentPositionMillis(){
         if (mEngineHandle == 0) return 0;
         return native_getCurrentPositionMillis(mEngineHandle);
@@ -85,7 +246,24 @@ public class PlaybackEngine {
     private static native long native_getTotalPatchMills(long engineHandle);
     private static native double native_getCurrentOutputLatencyMillis(long engineHandle);
     private static native void native_setDefaultStreamValues(int sampleRate, int channelCount, int framesPerBurst);
-    private static native void native_prepare(long engineHandle, String filePath);
-    private static native void native_play(long engineHandle, long offset, long size);
+    private static native void native_setLatencyProfilePath(String filePath);
+    private static native void native_setOutputRouteType(int routeType);
+    private static native boolean native_setTimeline(long engineHandle, String[] trackPaths, int[] channelCounts, long[] entries, int sampleRate, long originMills);
+    private static native boolean native_prefetch(long engineHandle, long serverTimeMills);
+    private static native void native_standBy(long engineHandle);
+    private static native void native_play(long engineHandle, long serverTimeMills);
+    private static native long native_getTimelinePositionMillis(long engineHandle, long serverTimeMills);
     private static native void native_setPlaybackShift(long engineHandle, long playbackShift);
+    private static native void native_setPeerSyncEnabled(long engineHandle, boolean isEnabled);
+    private static native int native_getPeerCount(long engineHandle);
+    private static native void native_setPowerSavingEnabled(long engineHandle, boolean isEnabled);
+    private static native double[] native_getCallbackStats(long engineHandle);
+    private static native double[] native_getSyncMetrics(long engineHandle);
+    private static native String native_getRenderCostReport(long engineHandle);
+    private static native void native_setPerformanceHintEnabled(long engineHandle, boolean isEnabled);
+    private static native void native_setRenderAheadMills(long engineHandle, int renderAheadMills);
+    private static native void native_setSyntheticLoad(long engineHandle, double loadFraction);
+    private static native String native_getCallbackTimingReport(long engineHandle);
+    private static native int[] native_buildPcmCache(AssetManager assetManager, String assetName, String outputPath, int threadCount);
+    private static native String native_benchmarkPcmCache(AssetManager assetManager, String assetName, String scratchPath);
 }
@@ -5,6 +5,7 @@ import android.content.Context.MODE_PRIVATE
 import android.media.MediaCodec
 import android.media.MediaExtractor
 import android.media.MediaFormat
+import java.io.File
 import kotlinx.coroutines.yield
 import timber.log.Timber
 
@@ -98,4 +99,23 @@ suspend fun convertMp3ToPcm(context: Context, inputFilename: String, outputFilen
         codec.release();
         outputStream.close()
     }
-}
\ No newline at end of file
+}
+
+/**
+ * @return offset of the first byte which differs between the files, or is missing from one of them,
+ * -1 if they are equal
+ */
+fun findFirstDifference(file1: File, file2: File): Long {
+    file1.inputStream().buffered().use { input1 ->
+        file2.inputStream().buffered().use { input2 ->
+            var offset = 0L
+            while (true) {
+                val byte1 = input1.read()
+                val byte2 = input2.read()
+                if (byte1 != byte2) return offset
+                if (byte1 < 0) return -1
+                offset++
+            }
+        }
+    }
+}
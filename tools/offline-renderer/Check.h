@@ -0,0 +1,35 @@
+#pragma once
+
+/**
+ * Checks of the host tests. A failed check is printed and counted, the test goes on.
+ */
+
+#include <cstdio>
+
+namespace {
+
+int gFailures = 0;
+
+/**
+ * @return exit code of a test once all its checks ran
+ */
+int finishChecks() {
+    if (gFailures > 0) {
+        fprintf(stderr, "%d checks failed\n", gFailures);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
+
+} // namespace
+
+#define CHECK(condition, ...) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "FAILED %s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fputc('\n', stderr); \
+            gFailures++; \
+        } \
+    } while (0)
@@ -0,0 +1,107 @@
+/**
+ * Loopback check of PeerSync: two processes, as two devices would, play the same loop 300 ms apart
+ * and exchange their positions over the multicast group for a few seconds. The follower must have
+ * measured its round trip to the reference and shift by the difference of the positions.
+ *
+ * Exits with 77, which ctest reports as skipped, where the host can't loop multicast back.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+#include "Check.h"
+#include "PeerSync.h"
+#include "utils.h"
+
+namespace {
+
+constexpr int64_t kSizeMills = 30000;
+constexpr int64_t kOffsetMills = 300;
+constexpr int64_t kRunMills = 3000;
+constexpr int64_t kToleranceMills = 3;
+constexpr int kSkipped = 77;
+
+struct Result {
+    bool isStarted;
+    bool isReference;
+    int32_t peerCount;
+    int64_t shiftMills;
+    double roundTripMills;
+};
+
+Result runPeer(int64_t offsetMills) {
+    PeerSync peerSync(
+            [offsetMills]() { return (static_cast<int64_t>(millsNow()) + offsetMills) % kSizeMills; },
+            [](int64_t) {});
+
+    Result result {};
+    result.isStarted = peerSync.start(kSizeMills);
+    if (!result.isStarted) return result;
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(kRunMills));
+    result.isReference = peerSync.isReference();
+    result.peerCount = peerSync.getPeerCount();
+    result.shiftMills = peerSync.getShiftMills();
+    result.roundTripMills = peerSync.getRoundTripMills();
+    peerSync.stop();
+    return result;
+}
+
+void printResult(const char *name, const Result& result) {
+    printf("%s: %s, %d peers, shift %lld ms, round trip %.3f ms\n", name,
+           result.isReference ? "reference" : "follower", result.peerCount,
+           static_cast<long long>(result.shiftMills), result.roundTripMills);
+}
+
+} // namespace
+
+int main() {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (child == 0) {
+        // Ahead of the parent by kOffsetMills
+        Result result = runPeer(kOffsetMills);
+        _exit(write(fds[1], &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+    }
+
+    Result parent = runPeer(0);
+    Result ahead {};
+    bool isRead = read(fds[0], &ahead, sizeof(ahead)) == sizeof(ahead);
+    int status;
+    waitpid(child, &status, 0);
+    if (!isRead) {
+        fprintf(stderr, "no result from the child process\n");
+        return 1;
+    }
+
+    if (!parent.isStarted || !ahead.isStarted || (parent.peerCount == 0 && ahead.peerCount == 0)) {
+        printf("skipped: multicast loopback is not available\n");
+        return kSkipped;
+    }
+    printResult("behind", parent);
+    printResult("ahead", ahead);
+
+    CHECK(parent.peerCount == 1 && ahead.peerCount == 1 && parent.isReference != ahead.isReference,
+          "expected one reference and one follower seeing each other");
+
+    // The follower moves to the position of the reference
+    const Result& follower = parent.isReference ? ahead : parent;
+    int64_t expectedShiftMills = parent.isReference ? -kOffsetMills : kOffsetMills;
+    CHECK(llabs(follower.shiftMills - expectedShiftMills) <= kToleranceMills, "follower shift %lld ms, expected %lld ms",
+          static_cast<long long>(follower.shiftMills), static_cast<long long>(expectedShiftMills));
+    CHECK(follower.roundTripMills >= 0, "follower hasn't measured the round trip to the reference");
+    return finishChecks();
+}
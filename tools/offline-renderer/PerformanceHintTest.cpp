@@ -0,0 +1,204 @@
+/**
+ * Host checks of the PerformanceHintController: the session is opened and closed on its control
+ * thread, never on the thread reporting, covers the threads set and follows them when they change.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "Check.h"
+#include "PerformanceHint.h"
+
+namespace {
+
+/**
+ * What the sessions have been asked for, and on which threads.
+ */
+struct Record {
+    std::mutex lock;
+    std::vector<std::vector<int32_t>> openedThreadIds;
+    std::vector<int32_t> openingThreads;
+    std::vector<int32_t> closingThreads;
+    int64_t openedTargetNanos = 0;
+    std::atomic<int64_t> reports {0};
+    std::atomic<int64_t> targetNanos {0};
+};
+
+class FakeSession : public PerformanceHintSession {
+public:
+    FakeSession(Record& record, int64_t targetNanos) : mRecord(record) { mRecord.targetNanos = targetNanos; }
+
+    ~FakeSession() override {
+        std::lock_guard<std::mutex> lock(mRecord.lock);
+        mRecord.closingThreads.push_back(gettid());
+    }
+
+    void updateTargetWorkDuration(int64_t targetNanos) override { mRecord.targetNanos = targetNanos; }
+    void reportActualWorkDuration(int64_t) override { mRecord.reports++; }
+
+private:
+    Record& mRecord;
+};
+
+PerformanceHintController::SessionFactory makeFactory(Record& record) {
+    return [&record](const std::vector<int32_t>& threadIds, int64_t targetNanos) {
+        std::lock_guard<std::mutex> lock(record.lock);
+        record.openedThreadIds.push_back(threadIds);
+        record.openingThreads.push_back(gettid());
+        record.openedTargetNanos = targetNanos;
+        return std::unique_ptr<PerformanceHintSession>(new FakeSession(record, targetNanos));
+    };
+}
+
+/**
+ * Reports from its own thread, as an audio thread, until stopped.
+ */
+class AudioThread {
+public:
+    AudioThread(PerformanceHintController& controller, std::atomic<int64_t>& targetNanos)
+            : mThread([this, &controller, &targetNanos] {
+        mThreadId = gettid();
+        while (!mIsStopping) {
+            controller.reportWorkDuration(mThreadId, 100000, targetNanos);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }) {
+        while (mThreadId == 0) std::this_thread::yield();
+    }
+
+    ~AudioThread() {
+        mIsStopping = true;
+        mThread.join();
+    }
+
+    int32_t getThreadId() const { return mThreadId; }
+
+private:
+    std::atomic<int32_t> mThreadId {0};
+    std::atomic<bool> mIsStopping {false};
+    std::thread mThread;
+};
+
+template <typename Condition>
+bool waitFor(Condition condition) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (!condition()) {
+        if (std::chrono::steady_clock::now() > deadline) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+size_t getCount(Record& record, std::vector<int32_t> Record::*threads) {
+    std::lock_guard<std::mutex> lock(record.lock);
+    return (record.*threads).size();
+}
+
+void testOpenAndClose() {
+    Record record;
+    std::atomic<int64_t> targetNanos {2000000};
+    PerformanceHintController controller(makeFactory(record));
+    AudioThread audioThread(controller, targetNanos);
+
+    // Nothing is opened before it is enabled
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    CHECK(getCount(record, &Record::openingThreads) == 0, "opened while disabled");
+
+    controller.setEnabled(true);
+    CHECK(waitFor([&] { return record.reports > 0; }), "no reports reached the session");
+    {
+        std::lock_guard<std::mutex> lock(record.lock);
+        CHECK(record.openedThreadIds.size() == 1, "opened %d sessions", static_cast<int>(record.openedThreadIds.size()));
+        CHECK(!record.openedThreadIds.empty() && record.openedThreadIds[0] == std::vector<int32_t> {audioThread.getThreadId()},
+              "opened for other threads");
+        CHECK(!record.openingThreads.empty() && record.openingThreads[0] != audioThread.getThreadId(), "opened on the audio thread");
+        CHECK(record.openedTargetNanos == 2000000, "opened with target %lld", static_cast<long long>(record.openedTargetNanos));
+    }
+
+    targetNanos = 1000000;
+    CHECK(waitFor([&] { return record.targetNanos == 1000000; }), "target not updated");
+
+    // The worker joins the session, which is reopened for both threads and the previous one closed
+    int32_t workerId = audioThread.getThreadId() + 1000000;
+    controller.setThreadId(PerformanceHintController::kWorkerThread, workerId);
+    CHECK(waitFor([&] { return getCount(record, &Record::closingThreads) == 1; }), "session not reopened");
+    {
+        std::lock_guard<std::mutex> lock(record.lock);
+        std::vector<int32_t> expected {audioThread.getThreadId(), workerId};
+        CHECK(record.openedThreadIds.size() == 2 && record.openedThreadIds[1] == expected, "reopened for other threads");
+        CHECK(!record.closingThreads.empty() && record.closingThreads[0] != audioThread.getThreadId(), "closed on the audio thread");
+    }
+
+    controller.setEnabled(false);
+    CHECK(waitFor([&] { return !controller.hasSession(); }), "session not closed when disabled");
+    {
+        std::lock_guard<std::mutex> lock(record.lock);
+        CHECK(record.closingThreads.size() == 2 && record.closingThreads[1] != audioThread.getThreadId(), "closed on the audio thread");
+    }
+}
+
+void testUnsupported() {
+    int openCount = 0;
+    std::atomic<int64_t> targetNanos {2000000};
+    PerformanceHintController controller([&openCount](const std::vector<int32_t>&, int64_t) {
+        openCount++;
+        return std::unique_ptr<PerformanceHintSession>();
+    });
+    controller.setEnabled(true);
+    {
+        AudioThread audioThread(controller, targetNanos);
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    // Tried once for the thread, not at every report
+    CHECK(openCount == 1, "tried to open %d times", openCount);
+    CHECK(!controller.hasSession(), "has a session");
+}
+
+void testRetryAfterThreadChange() {
+    Record record;
+    std::atomic<int> openCount {0};
+    std::atomic<int64_t> targetNanos {2000000};
+    auto factory = makeFactory(record);
+    PerformanceHintController controller([&openCount, &factory](const std::vector<int32_t>& threadIds, int64_t targetNanos) {
+        // The first open fails, e.g. while the system is busy
+        return openCount++ == 0 ? std::unique_ptr<PerformanceHintSession>() : factory(threadIds, targetNanos);
+    });
+    controller.setEnabled(true);
+    AudioThread audioThread(controller, targetNanos);
+    CHECK(waitFor([&] { return openCount == 1; }), "not opened");
+
+    // The worker comes and goes, the session is then opened for the same audio thread as before
+    int32_t workerId = audioThread.getThreadId() + 1000000;
+    controller.setThreadId(PerformanceHintController::kWorkerThread, workerId);
+    controller.setThreadId(PerformanceHintController::kWorkerThread, 0);
+    std::vector<int32_t> expected {audioThread.getThreadId()};
+    CHECK(waitFor([&] {
+        std::lock_guard<std::mutex> lock(record.lock);
+        return !record.openedThreadIds.empty() && record.openedThreadIds.back() == expected;
+    }), "not retried after the threads changed");
+    CHECK(controller.hasSession(), "no session");
+}
+
+void testPlatformSession() {
+    // The logging session on the host
+    auto session = PerformanceHintSession::open({gettid()}, 1000000);
+    CHECK(session != nullptr, "no session");
+    if (session) {
+        session->updateTargetWorkDuration(2000000);
+        session->reportActualWorkDuration(500000);
+    }
+}
+
+} // namespace
+
+int main() {
+    testOpenAndClose();
+    testUnsupported();
+    testRetryAfterThreadChange();
+    testPlatformSession();
+    return finishChecks();
+}
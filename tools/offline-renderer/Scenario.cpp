@@ -0,0 +1,198 @@
+#include "Scenario.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+std::string directoryOf(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+}
+
+std::string baseNameOf(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    return dot == std::string::npos || dot == 0 ? name : name.substr(0, dot);
+}
+
+bool readValues(std::istringstream& line, std::vector<double>& values) {
+    std::string token;
+    while (line >> token) {
+        char *end;
+        values.push_back(strtod(token.c_str(), &end));
+        if (*end != '\0') {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool parseEvent(const std::string& command, std::istringstream& line, ScenarioEvent& event) {
+    if (command == "play") {
+        event.type = ScenarioEvent::Type::Play;
+    } else if (command == "shift") {
+        event.type = ScenarioEvent::Type::Shift;
+    } else if (command == "server-offset") {
+        event.type = ScenarioEvent::Type::ServerOffset;
+    } else if (command == "latency") {
+        event.type = ScenarioEvent::Type::Latency;
+    } else if (command == "reported-latency") {
+        event.type = ScenarioEvent::Type::ReportedLatency;
+        std::string token;
+        if (line.str().find("none") != std::string::npos) {
+            return line >> token && token == "none" && !(line >> token);
+        }
+    } else if (command == "default-latency") {
+        event.type = ScenarioEvent::Type::DefaultLatency;
+    } else if (command == "callback") {
+        event.type = ScenarioEvent::Type::Callback;
+    } else if (command == "stall") {
+        event.type = ScenarioEvent::Type::Stall;
+    } else if (command == "disconnect") {
+        event.type = ScenarioEvent::Type::Disconnect;
+    } else {
+        return false;
+    }
+
+    if (!readValues(line, event.values)) {
+        return false;
+    }
+    switch (event.type) {
+        case ScenarioEvent::Type::Play:
+            return event.values.empty();
+        case ScenarioEvent::Type::Callback:
+            return !event.values.empty() &&
+                   std::all_of(event.values.begin(), event.values.end(), [](double frames) {
+                       return frames >= 1 && frames == static_cast<int32_t>(frames);
+                   });
+        default:
+            return event.values.size() == 1;
+    }
+}
+
+} // namespace
+
+bool parseScenario(const std::string& path, Scenario& scenario, std::string& error) {
+    std::ifstream file(path);
+    if (!file) {
+        error = "can't open " + path;
+        return false;
+    }
+
+    scenario = Scenario();
+    scenario.name = baseNameOf(path);
+
+    bool hasPlay = false;
+    std::string text;
+    for (int lineNumber = 1; std::getline(file, text); lineNumber++) {
+        text = text.substr(0, text.find('#'));
+        std::istringstream line(text);
+        std::string command;
+        if (!(line >> command)) {
+            continue;
+        }
+
+        double atMills = 0;
+        bool isTimed = command == "at";
+        if (isTimed && !(line >> atMills >> command)) {
+            error = path + ":" + std::to_string(lineNumber) + ": expected at <mills> <command>";
+            return false;
+        }
+
+        bool isValid = true;
+        std::string value;
+        if (command == "pcm" && !isTimed) {
+            isValid = static_cast<bool>(line >> value) && !(line >> value);
+            scenario.pcmPath = value.empty() || value[0] == '/' ? value : directoryOf(path) + value;
+        } else if (command == "ramp" && !isTimed) {
+            scenario.isRamp = true;
+            isValid = !(line >> value);
+        } else if (command == "format" && !isTimed) {
+            isValid = static_cast<bool>(line >> scenario.sampleRate >> scenario.channelCount);
+            if (!(line >> scenario.sourceChannelCount)) {
+                scenario.sourceChannelCount = scenario.channelCount;
+            }
+            line.clear();
+            isValid &= !(line >> value) && scenario.sampleRate > 0 && scenario.channelCount > 0 &&
+                    scenario.sourceChannelCount > 0;
+        } else if (command == "size" && !isTimed) {
+            isValid = line >> scenario.sizeMills && !(line >> value) && scenario.sizeMills > 0;
+        } else if (command == "offset" && !isTimed) {
+            isValid = line >> scenario.offsetMills && !(line >> value) && scenario.offsetMills >= 0;
+        } else if (command == "duration" && !isTimed) {
+            isValid = line >> scenario.durationMills && !(line >> value) && scenario.durationMills > 0;
+        } else if (command == "drift" && !isTimed) {
+            isValid = line >> scenario.driftPpm && !(line >> value);
+        } else if (command == "latency-jitter" && !isTimed) {
+            isValid = line >> scenario.latencyJitterMills && !(line >> value) && scenario.latencyJitterMills >= 0;
+        } else if ((command == "entry" || command == "gap") && !isTimed) {
+            ScenarioEntry entry {command == "gap", 0, 0, 1};
+            isValid = (entry.isGap || line >> entry.startMills) && line >> entry.mills;
+            if (!(line >> entry.repeatCount)) {
+                entry.repeatCount = 1;
+            }
+            line.clear();
+            isValid &= !(line >> value) && entry.startMills >= 0 && entry.mills > 0 && entry.repeatCount > 0;
+            scenario.entries.push_back(entry);
+        } else if (command == "render-ahead" && !isTimed) {
+            isValid = line >> scenario.renderAheadFrames >> scenario.renderAheadChunkFrames && !(line >> value) &&
+                    scenario.renderAheadChunkFrames > 0 && scenario.renderAheadFrames >= scenario.renderAheadChunkFrames;
+        } else if (command == "sync-gains" && !isTimed) {
+            SyncController::Config& config = scenario.syncConfig;
+            isValid = line >> config.proportionalGain >> config.integralGain && !(line >> value) &&
+                    config.proportionalGain > 0 && config.integralGain >= 0;
+        } else if (command == "sync-limits" && !isTimed) {
+            SyncController::Config& config = scenario.syncConfig;
+            isValid = line >> config.maxCorrectionRate >> config.maxSlewRate &&
+                    config.maxCorrectionRate > 0 && config.maxSlewRate > 0;
+            double hardSyncMills;
+            if (isValid && line >> hardSyncMills) {
+                config.hardSyncThresholdMills = hardSyncMills;
+                isValid = hardSyncMills > 0 && !(line >> value);
+            }
+        } else if (command == "sync-acquisition" && !isTimed) {
+            SyncController::Config& config = scenario.syncConfig;
+            isValid = line >> config.acquisitionThresholdMills >> config.maxAcquisitionRate && !(line >> value) &&
+                    config.acquisitionThresholdMills > 0 && config.maxAcquisitionRate > 0;
+        } else if (command == "expect" && !isTimed) {
+            ScenarioExpectation expectation;
+            std::string bound;
+            isValid = line >> expectation.metric >> bound >> expectation.value && !(line >> value) &&
+                    (bound == "<=" || bound == ">=");
+            expectation.isUpperBound = bound == "<=";
+            scenario.expectations.push_back(expectation);
+        } else {
+            ScenarioEvent event {atMills, ScenarioEvent::Type::Play};
+            isValid = parseEvent(command, line, event);
+            hasPlay |= isValid && event.type == ScenarioEvent::Type::Play;
+            scenario.events.push_back(event);
+        }
+
+        if (!isValid) {
+            error = path + ":" + std::to_string(lineNumber) + ": malformed " + command;
+            return false;
+        }
+    }
+
+    if (scenario.isRamp == !scenario.pcmPath.empty()) {
+        error = path + ": exactly one of pcm and ramp is expected";
+        return false;
+    }
+    if (scenario.isRamp && scenario.sizeMills == 0) {
+        error = path + ": ramp requires size";
+        return false;
+    }
+
+    if (!hasPlay) {
+        scenario.events.insert(scenario.events.begin(), ScenarioEvent {0, ScenarioEvent::Type::Play});
+    }
+    std::stable_sort(scenario.events.begin(), scenario.events.end(),
+                     [](const ScenarioEvent& a, const ScenarioEvent& b) {
+                         return a.timeMills < b.timeMills;
+                     });
+    return true;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "SyncController.h"
+
+/**
+ * Something happening to the generator or the stream at a given time of the scenario.
+ */
+struct ScenarioEvent {
+    enum class Type {
+        Play,
+        Shift,
+        ServerOffset,
+        Latency,
+        ReportedLatency,
+        DefaultLatency,
+        Callback,
+        Stall,
+        Disconnect
+    };
+
+    double timeMills;
+    Type type;
+    // Empty for `reported-latency none`, several frame counts for `callback`
+    std::vector<double> values;
+};
+
+/**
+ * Entry of the timeline schedule, a range of the source or a gap of silence.
+ */
+struct ScenarioEntry {
+    bool isGap;
+    int64_t startMills;
+    int64_t mills;
+    int32_t repeatCount;
+};
+
+/**
+ * Bound of a metric of the rendered scenario, failing the run if it is exceeded.
+ */
+struct ScenarioExpectation {
+    std::string metric;
+    bool isUpperBound;
+    double value;
+};
+
+/**
+ * Scenario script, one command per line, `#` starts a comment:
+ *
+ *   pcm <file>              raw PCM I16 source, relative to the script, or
+ *   ramp                    source whose every sample holds its own frame index, modulo 65536,
+ *                           this lets the renderer measure the synchronization error exactly
+ *   format <rate> <channels> [<file channels>]  stream format, the file has the stream channels by default
+ *   size <mills>            loop size, by default the whole pcm file, required for ramp
+ *   entry <start mills> <mills> [<repeats>]  play the range of the source, the entries and gaps
+ *                           make the schedule looped instead of the whole source
+ *   gap <mills> [<repeats>] silence in the schedule
+ *   offset <mills>          position to start from
+ *   duration <mills>        length of the rendered stream
+ *   drift <ppm>             device clock drift against the system clock
+ *   latency-jitter <mills>  uniform noise of every reported latency
+ *   render-ahead <frames> <chunk frames>  render through a RenderAheadBuffer of the given capacity,
+ *                           which is filled up chunk by chunk before every callback
+ *   sync-gains <proportional> <integral>  gains of the SyncController, its defaults otherwise
+ *   sync-limits <max rate> <max slew rate> [<hard sync mills>]  limits of the SyncController
+ *   sync-acquisition <threshold mills> <max rate>  rate limit of the SyncController for large errors
+ *   expect <metric> <=|>= <value>  bound checked once the scenario is rendered, the metrics are
+ *                           lock-time, max-error, rms-error, max-unlocked-time (measured on ramp
+ *                           sources from the lock on), total-patch, silence-frames, soft-corrections, hard-corrections,
+ *                           estimated-p50, estimated-p99, estimated-max, in-lock (percent of the
+ *                           playing time), first-sample and estimated-lock-time, in mills unless noted;
+ *                           a time to lock which never happened exceeds every bound
+ *   [at <mills>] play                          when play is called, 0 by default
+ *   [at <mills>] shift <mills>                 setPlaybackShift
+ *   [at <mills>] server-offset <mills>         server time update, which moves the start position
+ *                                              before play and is forwarded as a shift after it
+ *   [at <mills>] latency <mills>               actual output latency, reported as is
+ *   [at <mills>] reported-latency <mills|none> latency reported by the stream, none fails it
+ *   [at <mills>] default-latency <mills>       setDefaultLatencyMills
+ *   [at <mills>] callback <frames> [...]       callback sizes, used in a cycle
+ *   [at <mills>] stall <mills>                 the render-ahead worker renders nothing meanwhile
+ *   [at <mills>] disconnect <mills>            the stream is disconnected and another one opened after
+ *                                              the time, with the latency of the previous one, its
+ *                                              generator continues the playback as OboeEngine::restart does
+ */
+struct Scenario {
+    std::string name;
+    std::string pcmPath;
+    bool isRamp {false};
+    int32_t sampleRate {48000};
+    int32_t channelCount {2};
+    int32_t sourceChannelCount {2};
+    int64_t sizeMills {0};
+    int64_t offsetMills {0};
+    double durationMills {10000};
+    double driftPpm {0};
+    double latencyJitterMills {0};
+    int32_t renderAheadFrames {0};
+    int32_t renderAheadChunkFrames {0};
+    SyncController::Config syncConfig;
+    std::vector<ScenarioEntry> entries;
+    std::vector<ScenarioExpectation> expectations;
+
+    // Sorted by time, events of the same time keep the script order
+    std::vector<ScenarioEvent> events;
+};
+
+/**
+ * @return false with the error filled if the script can't be read or is malformed
+ */
+bool parseScenario(const std::string& path, Scenario& scenario, std::string& error);
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "IPlaybackStream.h"
+
+/**
+ * Stream with a virtual clock, which advances only when the renderer consumes a callback.
+ * Time starts at 0 and all scenario event times are in this base.
+ */
+class SimulatedStream : public IPlaybackStream {
+public:
+    /**
+     * @param startMills time of the first frame, a stream opened later goes on in the same time base
+     */
+    SimulatedStream(int32_t sampleRate, int32_t channelCount, double driftPpm, double startMills = 0)
+            : mSampleRate(sampleRate),
+              mChannelCount(channelCount),
+              mFrameMills(1000.0 / (sampleRate * (1 + driftPpm / 1000000))),
+              mStartMills(startMills),
+              mNowMills(startMills) {}
+
+    int32_t getSampleRate() const override { return mSampleRate; }
+    int32_t getChannelCount() const override { return mChannelCount; }
+    int64_t getFramesWritten() override { return mFramesWritten; }
+
+    bool calculateLatencyMillis(double &latencyMills) override {
+        if (!mIsLatencyReported) {
+            return false;
+        }
+        latencyMills = mReportedLatencyMills;
+        if (mLatencyJitterMills > 0) {
+            // Deterministic, so the output can be compared to the golden one
+            mJitterState = mJitterState * 6364136223846793005ULL + 1442695040888963407ULL;
+            double uniform = static_cast<double>(mJitterState >> 11) / (1ULL << 53);
+            latencyMills += (2 * uniform - 1) * mLatencyJitterMills;
+        }
+        return true;
+    }
+
+    double nowMills() override { return mNowMills; }
+
+    /**
+     * Consume the frames rendered by a callback, the device clock may drift from the system one.
+     */
+    void advance(int32_t numFrames) {
+        mFramesWritten += numFrames;
+        mNowMills = mStartMills + mFramesWritten * mFrameMills;
+    }
+
+    /**
+     * Set the latency the output actually has, it is reported as is unless overridden.
+     */
+    void setLatencyMills(double latencyMills) { mLatencyMills = latencyMills; }
+    double getLatencyMills() const { return mLatencyMills; }
+
+    void setReportedLatencyMills(double latencyMills) {
+        mReportedLatencyMills = latencyMills;
+        mIsLatencyReported = true;
+    }
+
+    void setLatencyUnavailable() { mIsLatencyReported = false; }
+
+    /**
+     * Take over the latency of another stream, as a stream reopened on the same route has.
+     */
+    void continueLatencyOf(const SimulatedStream& other) {
+        mLatencyMills = other.mLatencyMills;
+        mReportedLatencyMills = other.mReportedLatencyMills;
+        mIsLatencyReported = other.mIsLatencyReported;
+        mLatencyJitterMills = other.mLatencyJitterMills;
+    }
+
+    /**
+     * Add uniform noise of up to the given amplitude to every reported latency, as the timestamps
+     * of real devices have.
+     */
+    void setLatencyJitterMills(double jitterMills) { mLatencyJitterMills = jitterMills; }
+
+private:
+    const int32_t mSampleRate;
+    const int32_t mChannelCount;
+    const double mFrameMills;
+    const double mStartMills;
+
+    int64_t mFramesWritten {0};
+    double mNowMills;
+
+    double mLatencyMills {0};
+    double mReportedLatencyMills {0};
+    bool mIsLatencyReported {false};
+    double mLatencyJitterMills {0};
+    uint64_t mJitterState {0};
+};
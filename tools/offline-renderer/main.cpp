@@ -0,0 +1,697 @@
+/**
+ * Renders SoundGenerator output for scripted scenarios on a host, @see Scenario.h for the script
+ * format. Every scenario is rendered to <output-dir>/<scenario>.wav as fast as the CPU allows,
+ * independent scenarios run on separate threads. Time is virtual, so the output is bit-exact
+ * between runs and can be compared with golden files. The run fails if any scenario misses one of
+ * its expectations.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "RenderAhead.h"
+#include "Scenario.h"
+#include "SimulatedStream.h"
+#include "SoundGenerator.h"
+#include "SyncMetrics.h"
+#include "Timeline.h"
+#include "Trace.h"
+
+namespace {
+
+constexpr int32_t kDefaultCallbackFrames = 192;
+constexpr double kLockThresholdMills = SyncMetrics::kLockThresholdMills;
+constexpr int64_t kRampPeriodFrames = 1 << 16;
+constexpr int64_t kBoundaryMarginMills = 50;
+
+struct Options {
+    std::vector<std::string> scenarioPaths;
+    std::string outputDir {"."};
+    std::string goldenDir;
+    std::string tracePath;
+    int threadCount {static_cast<int>(std::max(1u, std::thread::hardware_concurrency()))};
+};
+
+struct Report {
+    enum class Golden {
+        None,
+        Match,
+        Mismatch,
+        Missing
+    };
+
+    std::string name;
+    std::string error;
+    int64_t frames {0};
+    double seconds {0};
+    int64_t totalPatchMills {0};
+    int64_t silenceFrames {0};
+
+    // Measured on ramp sources only, by the first frame of every callback
+    bool hasSyncError {false};
+    double timeToLockMills {-1};
+    double maxErrorMills {0};
+    double rmsErrorMills {0};
+    // Longest time the error stayed beyond the lock threshold once locked
+    double maxUnlockedMills {0};
+
+    // As estimated by the generator itself
+    SyncMetrics::Snapshot syncMetrics;
+
+    Golden golden {Golden::None};
+    std::vector<std::string> failedExpectations;
+};
+
+void printUsage() {
+    fprintf(stderr,
+            "usage: offline_renderer [-o <output-dir>] [-g <golden-dir>] [-j <threads>]"
+            " [--trace <file.json>] <scenario>...\n");
+}
+
+bool parseOptions(int argc, char **argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "-o" && hasValue) {
+            options.outputDir = argv[++i];
+        } else if (arg == "-g" && hasValue) {
+            options.goldenDir = argv[++i];
+        } else if (arg == "-j" && hasValue) {
+            options.threadCount = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--trace" && hasValue) {
+            options.tracePath = argv[++i];
+        } else if (!arg.empty() && arg[0] != '-') {
+            options.scenarioPaths.push_back(arg);
+        } else {
+            return false;
+        }
+    }
+    return !options.scenarioPaths.empty();
+}
+
+class WavWriter {
+public:
+    WavWriter(const std::string& path, int32_t sampleRate, int32_t channelCount)
+            : mFile(fopen(path.c_str(), "wb")), mSampleRate(sampleRate), mChannelCount(channelCount) {
+        if (mFile != nullptr) {
+            writeHeader();
+        }
+    }
+
+    ~WavWriter() {
+        if (mFile != nullptr) {
+            fclose(mFile);
+        }
+    }
+
+    bool isOpen() const { return mFile != nullptr; }
+
+    void write(const int16_t *audioData, int32_t numFrames) {
+        mDataBytes += fwrite(audioData, sizeof(int16_t) * mChannelCount, numFrames, mFile) *
+                sizeof(int16_t) * mChannelCount;
+    }
+
+    /**
+     * Patch the sizes in the header, @return false if anything failed to be written
+     */
+    bool finish() {
+        fflush(mFile);
+        bool isOk = !ferror(mFile);
+        fseek(mFile, 0, SEEK_SET);
+        writeHeader();
+        isOk &= fclose(mFile) == 0;
+        mFile = nullptr;
+        return isOk;
+    }
+
+private:
+    void writeHeader() {
+        auto put16 = [this](uint16_t value) {
+            uint8_t bytes[] = {static_cast<uint8_t>(value), static_cast<uint8_t>(value >> 8)};
+            fwrite(bytes, 1, sizeof(bytes), mFile);
+        };
+        auto put32 = [&put16](uint32_t value) {
+            put16(value & 0xffff);
+            put16(value >> 16);
+        };
+        uint16_t blockAlign = mChannelCount * sizeof(int16_t);
+
+        fwrite("RIFF", 1, 4, mFile);
+        put32(36 + mDataBytes);
+        fwrite("WAVEfmt ", 1, 8, mFile);
+        put32(16);
+        put16(1); // PCM
+        put16(mChannelCount);
+        put32(mSampleRate);
+        put32(mSampleRate * blockAlign);
+        put16(blockAlign);
+        put16(16);
+        fwrite("data", 1, 4, mFile);
+        put32(mDataBytes);
+    }
+
+    FILE *mFile;
+    const int32_t mSampleRate;
+    const int32_t mChannelCount;
+    uint32_t mDataBytes {0};
+};
+
+bool readFile(const std::string& path, std::vector<char>& data) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return !file.bad();
+}
+
+/**
+ * Load the source samples, resolving the loop size of a pcm source if it is not set
+ */
+std::shared_ptr<char> loadSource(Scenario& scenario, int64_t& sourceFrames, std::string& error) {
+    int64_t frameBytes = scenario.sourceChannelCount * sizeof(int16_t);
+    int64_t sizeFrames = scenario.sizeMills * scenario.sampleRate / 1000;
+
+    if (scenario.isRamp) {
+        sourceFrames = sizeFrames;
+        std::shared_ptr<char> buffer(new char[sourceFrames * frameBytes], std::default_delete<char[]>());
+        auto samples = reinterpret_cast<int16_t*>(buffer.get());
+        for (int64_t frame = 0; frame < sourceFrames; frame++) {
+            std::fill_n(samples + frame * scenario.sourceChannelCount, scenario.sourceChannelCount,
+                        static_cast<int16_t>(frame % kRampPeriodFrames));
+        }
+        return buffer;
+    }
+
+    std::vector<char> data;
+    if (!readFile(scenario.pcmPath, data)) {
+        error = "can't read " + scenario.pcmPath;
+        return nullptr;
+    }
+    int64_t fileFrames = data.size() / frameBytes;
+    if (scenario.sizeMills == 0) {
+        scenario.sizeMills = fileFrames * 1000 / scenario.sampleRate;
+        sizeFrames = scenario.sizeMills * scenario.sampleRate / 1000;
+    }
+    if (sizeFrames == 0 || sizeFrames > fileFrames) {
+        error = scenario.pcmPath + " is shorter than the loop size";
+        return nullptr;
+    }
+
+    sourceFrames = fileFrames;
+    std::shared_ptr<char> buffer(new char[fileFrames * frameBytes], std::default_delete<char[]>());
+    memcpy(buffer.get(), data.data(), fileFrames * frameBytes);
+    return buffer;
+}
+
+/**
+ * Schedule of the scenario entries over the source, or of the loop size of it
+ */
+std::shared_ptr<Timeline> createTimeline(const Scenario& scenario, std::shared_ptr<char> buffer,
+                                         int64_t sourceFrames, std::string& error) {
+    auto toFrames = [&scenario](int64_t mills) { return mills * scenario.sampleRate / 1000; };
+    auto timeline = std::make_shared<Timeline>(scenario.sampleRate, 0);
+    int32_t track = timeline->addTrack(std::move(buffer), scenario.sourceChannelCount, sourceFrames);
+
+    bool isValid = true;
+    if (scenario.entries.empty()) {
+        isValid = timeline->addEntry(track, 0, toFrames(scenario.sizeMills));
+    }
+    for (const ScenarioEntry& entry : scenario.entries) {
+        isValid &= timeline->addEntry(entry.isGap ? Timeline::kGap : track, toFrames(entry.startMills),
+                                      toFrames(entry.mills), entry.repeatCount);
+    }
+    if (!isValid || !timeline->compile()) {
+        error = "timeline entry out of the source";
+        return nullptr;
+    }
+    return timeline;
+}
+
+/**
+ * @return false if the schedule frame is in a gap or next to an entry boundary, where the ramp
+ * value doesn't tell which side of the boundary is played
+ */
+bool locateTrackFrame(const Timeline& timeline, int64_t scheduleFrame, int64_t marginFrames, int64_t& trackFrame) {
+    int64_t periodFrames = timeline.getPeriodFrames();
+    Timeline::Location before = timeline.locate((scheduleFrame - marginFrames + periodFrames) % periodFrames);
+    Timeline::Location location = timeline.locate(scheduleFrame);
+    if (location.trackIndex == Timeline::kGap || before.trackIndex == Timeline::kGap
+            || before.trackFrame + marginFrames != location.trackFrame || location.framesToBoundary <= marginFrames) {
+        return false;
+    }
+    trackFrame = location.trackFrame;
+    return true;
+}
+
+/**
+ * A ramp sample tells the buffer position modulo kRampPeriodFrames only, so take the position it
+ * may come from which is the closest one to the expected position along the loop.
+ */
+int64_t measureErrorFrames(int64_t rampValue, int64_t expectedFrames, int64_t sizeFrames) {
+    int64_t errorFrames = sizeFrames;
+    for (int64_t position = rampValue; position < sizeFrames; position += kRampPeriodFrames) {
+        int64_t forward = (position - expectedFrames + sizeFrames) % sizeFrames;
+        int64_t error = forward <= sizeFrames / 2 ? forward : forward - sizeFrames;
+        if (llabs(error) < llabs(errorFrames)) {
+            errorFrames = error;
+        }
+    }
+    return errorFrames;
+}
+
+/**
+ * Do what the render-ahead worker would do between two callbacks: render chunks while there is room.
+ */
+void renderAhead(RenderAheadBuffer& buffer, SoundGenerator& generator) {
+    while (buffer.getFreeFrames() >= buffer.getChunkFrames()) {
+        for (int32_t remainingFrames = buffer.getChunkFrames(); remainingFrames > 0;) {
+            int32_t numFrames;
+            int16_t *region = buffer.getWriteRegion(numFrames);
+            numFrames = std::min(numFrames, remainingFrames);
+            generator.renderAudio(region, numFrames);
+            buffer.commitWrite(numFrames);
+            remainingFrames -= numFrames;
+        }
+    }
+}
+
+/**
+ * Stream the scenario is rendered to and the generator rendering into it.
+ */
+struct Output {
+    std::shared_ptr<SimulatedStream> stream;
+    std::shared_ptr<RenderAheadBuffer> renderAheadBuffer;
+    std::shared_ptr<SoundGenerator> generator;
+
+    // Of the generators of the disconnected streams, as OboeEngine collects them
+    SyncMetrics replacedMetrics;
+    int64_t replacedPatchMills {0};
+};
+
+/**
+ * Open a stream starting at the time with its generator, which continues the playback of the
+ * previous generator if any, as OboeEngine::openStream does.
+ */
+void openOutput(const Scenario& scenario, const std::shared_ptr<Timeline>& timeline, double startMills,
+                Output& output) {
+    auto stream = std::make_shared<SimulatedStream>(scenario.sampleRate, scenario.channelCount,
+                                                    scenario.driftPpm, startMills);
+    std::shared_ptr<RenderAheadBuffer> renderAheadBuffer;
+    std::shared_ptr<IPlaybackStream> generatorStream = stream;
+    if (scenario.renderAheadFrames > 0) {
+        renderAheadBuffer = std::make_shared<RenderAheadBuffer>(scenario.sampleRate, scenario.channelCount,
+                scenario.renderAheadFrames, scenario.renderAheadChunkFrames);
+        generatorStream = std::make_shared<RenderAheadStream>(stream, renderAheadBuffer);
+    }
+    auto generator = std::make_shared<SoundGenerator>(generatorStream);
+    generator->setSyncConfig(scenario.syncConfig);
+
+    if (output.generator) {
+        stream->continueLatencyOf(*output.stream);
+        // What the latency profile of the route would give
+        generator->setDefaultLatencyMills(output.generator->getLearnedLatencyMills());
+        generator->continueFrom(*output.generator);
+        output.replacedMetrics.add(output.generator->getSyncMetrics());
+        output.replacedPatchMills += output.generator->getTotalPatchMills();
+    } else {
+        stream->setLatencyJitterMills(scenario.latencyJitterMills);
+        generator->prepare(timeline);
+    }
+
+    output.stream = std::move(stream);
+    output.renderAheadBuffer = std::move(renderAheadBuffer);
+    output.generator = std::move(generator);
+}
+
+/**
+ * Where the playback should be, as the app requests it.
+ */
+struct Playback {
+    double playMills {-1};
+    int64_t startOffsetMills {0};
+    int64_t shiftMills {0};
+    // Server time against the scenario time, and as it was when play was called
+    int64_t serverOffsetMills {0};
+    int64_t playServerOffsetMills {0};
+};
+
+void applyEvent(const ScenarioEvent& event, const Scenario& scenario, const std::shared_ptr<Timeline>& timeline,
+                Output& output, std::vector<int32_t>& callbackFrames, Playback& playback, double& stallEndMills) {
+    SimulatedStream& stream = *output.stream;
+    SoundGenerator& generator = *output.generator;
+    switch (event.type) {
+        case ScenarioEvent::Type::Play:
+            // As PeremenManager does: positioned by the server time known now, without a shift
+            playback.playMills = stream.nowMills();
+            playback.playServerOffsetMills = playback.serverOffsetMills;
+            playback.startOffsetMills = scenario.offsetMills + playback.serverOffsetMills;
+            playback.shiftMills = 0;
+            generator.setPlaybackShift(0);
+            generator.play(playback.startOffsetMills, stream.nowMills());
+            break;
+        case ScenarioEvent::Type::Shift:
+            playback.shiftMills = static_cast<int64_t>(event.values[0]);
+            generator.setPlaybackShift(playback.shiftMills);
+            break;
+        case ScenarioEvent::Type::ServerOffset:
+            // Forwarded as a shift once playing only
+            playback.serverOffsetMills = static_cast<int64_t>(event.values[0]);
+            if (playback.playMills >= 0) {
+                playback.shiftMills = playback.serverOffsetMills - playback.playServerOffsetMills;
+                generator.setPlaybackShift(playback.shiftMills);
+            }
+            break;
+        case ScenarioEvent::Type::Latency:
+            stream.setLatencyMills(event.values[0]);
+            stream.setReportedLatencyMills(event.values[0]);
+            break;
+        case ScenarioEvent::Type::ReportedLatency:
+            if (event.values.empty()) {
+                stream.setLatencyUnavailable();
+            } else {
+                stream.setReportedLatencyMills(event.values[0]);
+            }
+            break;
+        case ScenarioEvent::Type::DefaultLatency:
+            generator.setDefaultLatencyMills(event.values[0]);
+            break;
+        case ScenarioEvent::Type::Callback:
+            callbackFrames.assign(event.values.begin(), event.values.end());
+            break;
+        case ScenarioEvent::Type::Stall:
+            stallEndMills = stream.nowMills() + event.values[0];
+            break;
+        case ScenarioEvent::Type::Disconnect:
+            openOutput(scenario, timeline, stream.nowMills() + event.values[0], output);
+            break;
+    }
+}
+
+/**
+ * @return false if the scenario doesn't have the metric
+ */
+bool getMetric(const Report& report, const std::string& metric, double& value) {
+    const SyncMetrics::Snapshot& sync = report.syncMetrics;
+    auto timeOf = [](double mills) { return mills >= 0 ? mills : INFINITY; };
+    if (report.hasSyncError && metric == "lock-time") {
+        value = timeOf(report.timeToLockMills);
+    } else if (report.hasSyncError && metric == "max-error") {
+        value = report.maxErrorMills;
+    } else if (report.hasSyncError && metric == "rms-error") {
+        value = report.rmsErrorMills;
+    } else if (report.hasSyncError && metric == "max-unlocked-time") {
+        value = report.maxUnlockedMills;
+    } else if (metric == "total-patch") {
+        value = static_cast<double>(report.totalPatchMills);
+    } else if (metric == "silence-frames") {
+        value = static_cast<double>(report.silenceFrames);
+    } else if (metric == "soft-corrections") {
+        value = static_cast<double>(sync.softCorrections);
+    } else if (metric == "hard-corrections") {
+        value = static_cast<double>(sync.hardCorrections);
+    } else if (metric == "estimated-p50") {
+        value = sync.p50Mills;
+    } else if (metric == "estimated-p99") {
+        value = sync.p99Mills;
+    } else if (metric == "estimated-max") {
+        value = sync.maxMills;
+    } else if (metric == "in-lock") {
+        value = sync.playingSeconds > 0 ? 100 * sync.lockedSeconds / sync.playingSeconds : 0;
+    } else if (metric == "first-sample") {
+        value = timeOf(sync.timeToFirstSampleMills);
+    } else if (metric == "estimated-lock-time") {
+        value = timeOf(sync.timeToLockMills);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void checkExpectations(const Scenario& scenario, Report& report) {
+    for (const ScenarioExpectation& expectation : scenario.expectations) {
+        double value;
+        if (!getMetric(report, expectation.metric, value)) {
+            report.error = "no metric " + expectation.metric;
+            return;
+        }
+        if (expectation.isUpperBound ? value > expectation.value : value < expectation.value) {
+            char text[128];
+            snprintf(text, sizeof(text), "%s %.3f %s %g", expectation.metric.c_str(), value,
+                     expectation.isUpperBound ? ">" : "<", expectation.value);
+            report.failedExpectations.emplace_back(text);
+        }
+    }
+}
+
+Report render(const std::string& path, const Options& options) {
+    Report report;
+    Scenario scenario;
+    if (!parseScenario(path, scenario, report.error)) {
+        return report;
+    }
+    report.name = scenario.name;
+
+    int64_t sourceFrames = 0;
+    std::shared_ptr<char> buffer = loadSource(scenario, sourceFrames, report.error);
+    if (!buffer) {
+        return report;
+    }
+    std::shared_ptr<Timeline> timeline = createTimeline(scenario, std::move(buffer), sourceFrames, report.error);
+    if (!timeline) {
+        return report;
+    }
+
+    std::string outputPath = options.outputDir + "/" + scenario.name + ".wav";
+    WavWriter writer(outputPath, scenario.sampleRate, scenario.channelCount);
+    if (!writer.isOpen()) {
+        report.error = "can't write " + outputPath;
+        return report;
+    }
+
+    Output output;
+    openOutput(scenario, timeline, 0, output);
+
+    std::vector<int32_t> callbackFrames {kDefaultCallbackFrames};
+    std::vector<int16_t> audioData;
+    Playback playback;
+    double stallEndMills = 0;
+    int64_t lockedCallbacks = 0;
+    double unlockedMills = -1;
+    double squaredErrorSum = 0;
+
+    auto nextEvent = scenario.events.begin();
+    auto startTime = std::chrono::steady_clock::now();
+
+    for (size_t callback = 0; output.stream->nowMills() < scenario.durationMills; callback++) {
+        for (; nextEvent != scenario.events.end() && nextEvent->timeMills <= output.stream->nowMills(); ++nextEvent) {
+            applyEvent(*nextEvent, scenario, timeline, output, callbackFrames, playback, stallEndMills);
+        }
+        SimulatedStream *stream = output.stream.get();
+        SoundGenerator& generator = *output.generator;
+        RenderAheadBuffer *renderAheadBuffer = output.renderAheadBuffer.get();
+
+        int32_t numFrames = callbackFrames[callback % callbackFrames.size()];
+        audioData.resize(numFrames * scenario.channelCount);
+        bool isRendered = true;
+        if (renderAheadBuffer) {
+            if (stream->nowMills() >= stallEndMills) {
+                renderAhead(*renderAheadBuffer, generator);
+            }
+            isRendered = renderAheadBuffer->read(audioData.data(), numFrames) == numFrames;
+        } else {
+            generator.renderAudio(audioData.data(), numFrames);
+        }
+        writer.write(audioData.data(), numFrames);
+
+        // Silence inserted on a render-ahead underrun doesn't tell the position
+        if (scenario.isRamp && playback.playMills >= 0 && isRendered) {
+            // Position of the first frame when it is actually presented, against the one it should have
+            double presentationMills = stream->nowMills() + stream->getLatencyMills();
+            double expectedMills = playback.startOffsetMills + presentationMills - playback.playMills +
+                    playback.shiftMills;
+            int64_t sizeFrames = timeline->getPeriodMills() * scenario.sampleRate / 1000;
+            int64_t expectedFrames = llround(expectedMills * scenario.sampleRate / 1000) % sizeFrames;
+            expectedFrames = (expectedFrames + sizeFrames) % sizeFrames;
+            auto rampValue = static_cast<uint16_t>(audioData[0]);
+            int64_t errorFrames;
+            if (scenario.entries.empty()) {
+                errorFrames = measureErrorFrames(rampValue, expectedFrames, sizeFrames);
+            } else if (!locateTrackFrame(*timeline, expectedFrames, kBoundaryMarginMills * scenario.sampleRate / 1000,
+                                         expectedFrames)) {
+                stream->advance(numFrames);
+                report.frames += numFrames;
+                continue;
+            } else {
+                errorFrames = measureErrorFrames(rampValue, expectedFrames, sourceFrames);
+            }
+            double errorMills = errorFrames * 1000.0 / scenario.sampleRate;
+
+            if (report.timeToLockMills < 0 && fabs(errorMills) <= kLockThresholdMills) {
+                report.timeToLockMills = stream->nowMills() - playback.playMills;
+            }
+            if (report.timeToLockMills >= 0) {
+                if (fabs(errorMills) > kLockThresholdMills && unlockedMills < 0) {
+                    unlockedMills = stream->nowMills();
+                } else if (fabs(errorMills) <= kLockThresholdMills && unlockedMills >= 0) {
+                    report.maxUnlockedMills = std::max(report.maxUnlockedMills, stream->nowMills() - unlockedMills);
+                    unlockedMills = -1;
+                }
+                report.maxErrorMills = std::max(report.maxErrorMills, fabs(errorMills));
+                squaredErrorSum += errorMills * errorMills;
+                lockedCallbacks++;
+            }
+            report.hasSyncError = true;
+        }
+
+        stream->advance(numFrames);
+        report.frames += numFrames;
+    }
+
+    if (unlockedMills >= 0) {
+        report.maxUnlockedMills = std::max(report.maxUnlockedMills, output.stream->nowMills() - unlockedMills);
+    }
+    report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    report.totalPatchMills = output.replacedPatchMills + output.generator->getTotalPatchMills();
+    SyncMetrics syncMetrics;
+    syncMetrics.add(output.replacedMetrics);
+    syncMetrics.add(output.generator->getSyncMetrics());
+    report.syncMetrics = syncMetrics.getSnapshot();
+    if (output.renderAheadBuffer) {
+        report.silenceFrames = output.renderAheadBuffer->getSilenceFrames();
+    }
+    if (lockedCallbacks > 0) {
+        report.rmsErrorMills = sqrt(squaredErrorSum / lockedCallbacks);
+    }
+
+    if (!writer.finish()) {
+        report.error = "failed to write " + outputPath;
+        return report;
+    }
+
+    checkExpectations(scenario, report);
+
+    if (!options.goldenDir.empty()) {
+        std::vector<char> output;
+        std::vector<char> golden;
+        if (!readFile(options.goldenDir + "/" + scenario.name + ".wav", golden)) {
+            report.golden = Report::Golden::Missing;
+        } else {
+            readFile(outputPath, output);
+            report.golden = output == golden ? Report::Golden::Match : Report::Golden::Mismatch;
+        }
+    }
+    return report;
+}
+
+void printReport(const Report& report) {
+    if (!report.error.empty()) {
+        printf("%s: error: %s\n", report.name.c_str(), report.error.c_str());
+        return;
+    }
+
+    printf("%s: %lld frames in %.3f s, %.0f frames/s, total patch %lld ms",
+           report.name.c_str(), static_cast<long long>(report.frames), report.seconds,
+           report.frames / std::max(report.seconds, 1e-9), static_cast<long long>(report.totalPatchMills));
+    if (report.silenceFrames > 0) {
+        printf(", %lld render-ahead silence frames", static_cast<long long>(report.silenceFrames));
+    }
+    if (report.hasSyncError) {
+        if (report.timeToLockMills >= 0) {
+            printf(", lock in %.1f ms, max error %.3f ms, rms error %.3f ms, longest out of lock %.1f ms",
+                   report.timeToLockMills, report.maxErrorMills, report.rmsErrorMills, report.maxUnlockedMills);
+        } else {
+            printf(", never locked");
+        }
+    }
+    const SyncMetrics::Snapshot& sync = report.syncMetrics;
+    if (sync.playingSeconds > 0) {
+        printf(", estimated error p50 %.3f p99 %.3f max %.3f ms, corrections %lld soft %lld hard, in lock %.1f%%",
+               sync.p50Mills, sync.p99Mills, sync.maxMills,
+               static_cast<long long>(sync.softCorrections), static_cast<long long>(sync.hardCorrections),
+               100 * sync.lockedSeconds / sync.playingSeconds);
+    }
+    if (sync.timeToFirstSampleMills >= 0) {
+        printf(", first sample in %.1f ms", sync.timeToFirstSampleMills);
+        if (sync.timeToLockMills >= 0) {
+            printf(", estimated lock in %.1f ms", sync.timeToLockMills);
+        }
+    }
+    static const char *kGolden[] = {"", ", golden: match", ", golden: MISMATCH", ", golden: missing"};
+    printf("%s\n", kGolden[static_cast<int>(report.golden)]);
+    for (const std::string& failure : report.failedExpectations) {
+        printf("%s: FAILED expect %s\n", report.name.c_str(), failure.c_str());
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage();
+        return 2;
+    }
+
+#ifdef PEREMEN_TRACING
+    trace::setEnabled(!options.tracePath.empty());
+#else
+    if (!options.tracePath.empty()) {
+        fprintf(stderr, "tracing is not compiled in, rebuild with -DPEREMEN_TRACING=ON\n");
+        return 2;
+    }
+#endif
+
+    std::vector<Report> reports(options.scenarioPaths.size());
+    std::atomic<size_t> nextScenario {0};
+    auto worker = [&]() {
+        for (size_t i; (i = nextScenario++) < reports.size();) {
+            reports[i] = render(options.scenarioPaths[i], options);
+            if (reports[i].name.empty()) {
+                reports[i].name = options.scenarioPaths[i];
+            }
+        }
+    };
+
+    auto startTime = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    int threadCount = std::min<int>(options.threadCount, reports.size());
+    for (int i = 0; i < threadCount; i++) {
+        threads.emplace_back(worker);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+    int64_t totalFrames = 0;
+    bool isFailed = false;
+    for (const auto& report : reports) {
+        printReport(report);
+        totalFrames += report.frames;
+        isFailed |= !report.error.empty() || !report.failedExpectations.empty() || report.golden == Report::Golden::Mismatch ||
+                report.golden == Report::Golden::Missing;
+    }
+    printf("total: %lld frames in %.3f s on %d threads, %.0f frames/s\n",
+           static_cast<long long>(totalFrames), seconds, threadCount,
+           totalFrames / std::max(seconds, 1e-9));
+
+#ifdef PEREMEN_TRACING
+    if (!options.tracePath.empty() && !trace::writeChromeJson(options.tracePath.c_str())) {
+        fprintf(stderr, "can't write %s\n", options.tracePath.c_str());
+        isFailed = true;
+    }
+#endif
+
+    return isFailed ? 1 : 0;
+}